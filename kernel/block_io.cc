@@ -18,8 +18,10 @@ int64_t BlockIO::read(uint32_t offset, uint32_t desired_n, char* buffer) {
     if (actual_n == block_size) {
         //Debug::printf("reading whole block %d\n",block_number);
         ASSERT(offset_in_block == 0);
-        // we can read in-place
-        read_block(block_number,buffer);
+        // we can read in-place, as many whole blocks as we were asked for
+        auto count = n / block_size;
+        read_blocks(block_number,count,buffer);
+        actual_n = count * block_size;
     } else {
         ASSERT(offset_in_block + actual_n <= block_size);
         char* temp = new char[block_size];
@@ -32,6 +34,20 @@ int64_t BlockIO::read(uint32_t offset, uint32_t desired_n, char* buffer) {
     return actual_n;
 }
 
+void BlockIO::read_blocks(uint32_t start, const IOVec* vec, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        ASSERT(vec[i].bytes % block_size == 0);
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            read_block(start++, vec[i].buffer + off);
+        }
+    }
+}
+
+void BlockIO::read_blocks_async(uint32_t start, const IOVec* vec, uint32_t n, Completion* done) {
+    read_blocks(start, vec, n);
+    done->complete();
+}
+
 int64_t BlockIO::read_all(uint32_t offset, uint32_t n, char* buffer) {
     int64_t total_count = 0;
     while (n > 0) {
@@ -44,4 +60,63 @@ int64_t BlockIO::read_all(uint32_t offset, uint32_t n, char* buffer) {
         buffer += cnt;
     }
     return total_count;
-}
\ No newline at end of file
+}
+
+bool BlockIO::write_block(uint32_t block_number, const char* buffer) {
+    Debug::panic("write_block(%d) on a read-only device\n",block_number);
+    return false;
+}
+
+bool BlockIO::write_blocks(uint32_t start, const IOVec* vec, uint32_t n) {
+    bool ok = true;
+    for (uint32_t i = 0; i < n; i++) {
+        ASSERT(vec[i].bytes % block_size == 0);
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            if (!write_block(start++, vec[i].buffer + off)) ok = false;
+        }
+    }
+    return ok;
+}
+
+int64_t BlockIO::write(uint32_t offset, uint32_t desired_n, const char* buffer) {
+    auto sz = size_in_bytes();
+    if (offset > sz) return -1;
+    if (offset == sz) return 0;
+
+    auto n = K::min(desired_n,sz - offset);
+    auto block_number = offset / block_size;
+    auto offset_in_block = offset % block_size;
+    auto actual_n = K::min(block_size - offset_in_block, n);
+    ASSERT(actual_n <= n);
+    ASSERT(offset + actual_n <= sz);
+    if (actual_n == block_size) {
+        ASSERT(offset_in_block == 0);
+        // we can write in-place, as many whole blocks as we were given
+        auto count = n / block_size;
+        if (!write_blocks(block_number,count,buffer)) return -1;
+        actual_n = count * block_size;
+    } else {
+        ASSERT(offset_in_block + actual_n <= block_size);
+        char* temp = new char[block_size];
+        read_block(block_number,temp);
+        ::memcpy(&temp[offset_in_block],buffer,actual_n);
+        auto ok = write_block(block_number,temp);
+        delete []temp;
+        if (!ok) return -1;
+    }
+    return actual_n;
+}
+
+int64_t BlockIO::write_all(uint32_t offset, uint32_t n, const char* buffer) {
+    int64_t total_count = 0;
+    while (n > 0) {
+        int64_t cnt = write(offset,n,buffer);
+        if (cnt < 0) return cnt;
+        if (cnt == 0) return total_count;
+        total_count += cnt;
+        offset += cnt;
+        n -= cnt;
+        buffer += cnt;
+    }
+    return total_count;
+}
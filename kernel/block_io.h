@@ -3,6 +3,7 @@
 
 #include "stdint.h"
 #include "debug.h"
+#include "atomic.h"
 
 //
 // Base class for things that support block IO (disks, files, directories, etc)
@@ -21,6 +22,41 @@
 //
 class BlockIO {
 public:
+    // A piece of a scatter-gather request, a multiple of the block size
+    struct IOVec {
+        char* buffer;
+        uint32_t bytes;
+    };
+
+    // Runs once an asynchronous transfer is done, maybe on another
+    // thread (a drive's queue thread). It shouldn't block or do I/O
+    struct Completion {
+        virtual ~Completion() {}
+        virtual void complete() = 0;
+    };
+
+    // For a transfer that goes out as several: completes done once each
+    // of them has, and once whoever hands them out calls complete() too
+    class Join : public Completion {
+        Atomic<uint32_t> left{1};
+        Completion* done;
+    public:
+        Join(Completion* done) : done(done) {}
+
+        // one more to wait for
+        Completion* add() {
+            left.add_fetch(1);
+            return this;
+        }
+
+        void complete() override {
+            if (left.add_fetch(-1) == 0) {
+                done->complete();
+                delete this;
+            }
+        }
+    };
+
     const uint32_t block_size;
     BlockIO(uint32_t block_size): block_size(block_size) {}
 
@@ -36,7 +72,25 @@ public:
     // Read a block and put its bytes in the given buffer
     virtual void read_block(uint32_t block_number, char* buffer) = 0;
 
+    // Read "count" blocks starting at "start" into the given buffer.
+    // Devices turn this into as few requests as they can
+    void read_blocks(uint32_t start, uint32_t count, char* buffer) {
+        IOVec v{buffer, count * block_size};
+        read_blocks(start, &v, 1);
+    }
+
+    // Scatter-gather: the blocks starting at "start" fill the n pieces,
+    // one after the other. The default reads a block at a time
+    virtual void read_blocks(uint32_t start, const IOVec* vec, uint32_t n);
+
+    // Start reading like read_blocks and return, maybe before the data is
+    // there. done->complete() is called once all of it is, the buffers
+    // belong to the transfer until then. The default reads them right
+    // away, devices with a request queue don't wait
+    virtual void read_blocks_async(uint32_t start, const IOVec* vec, uint32_t n, Completion* done);
+
     // Read up to "n" bytes starting at "offset" and put the restuls in "buffer".
+    // Whole blocks are read with one read_blocks request.
     // returns:
     //   > 0  actual number of bytes read
     //   = 0  end (offset == size_in_bytes)
@@ -52,6 +106,43 @@ public:
     //
     virtual int64_t read_all(uint32_t offset, uint32_t n, char* buffer);
 
+    // Write a block from the given buffer. Returns false if the block
+    // can't be written. Read-only devices don't override this and panic
+    // when asked to write
+    virtual bool write_block(uint32_t block_number, const char* buffer);
+
+    // Scatter-gather: the n pieces, one after the other, go to the blocks
+    // starting at "start". Returns false if some of them couldn't be
+    // written, the rest are. The default writes a block at a time
+    virtual bool write_blocks(uint32_t start, const IOVec* vec, uint32_t n);
+
+    // Write "count" blocks starting at "start" from the given buffer.
+    // Devices turn this into as few requests as they can
+    bool write_blocks(uint32_t start, uint32_t count, const char* buffer) {
+        IOVec v{(char*) buffer, count * block_size};
+        return write_blocks(start, &v, 1);
+    }
+
+    // Write up to "n" bytes from "buffer" starting at "offset". Partial
+    // blocks are read, patched, and written back. Whole blocks are
+    // written with one write_blocks request.
+    // returns:
+    //   > 0  actual number of bytes written
+    //   = 0  end (offset == size_in_bytes)
+    //   -1   error (offset > size_in_bytes, or write_block failed)
+    virtual int64_t write(uint32_t offset, uint32_t n, const char* buffer);
+
+    // Write min(n,size_in_bytes - offset) bytes from "buffer" starting
+    //      at "offset". Never grows the object.
+    // returns:
+    //    > 0 actual number of bytes written
+    //    = 0 end (offset == size_in_bytes)
+    //    -1 error (offset > size_in_bytes)
+    virtual int64_t write_all(uint32_t offset, uint32_t n, const char* buffer);
+
+    // Make sure everything written so far is durable
+    virtual void sync() {}
+
     template <typename T>
     void read(uint32_t offset, T& thing) {
         auto cnt = read_all(offset,sizeof(T),(char*)&thing);
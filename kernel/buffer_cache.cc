@@ -0,0 +1,243 @@
+#include "buffer_cache.h"
+#include "config.h"
+#include "debug.h"
+#include "threads.h"
+#include "libk.h"
+
+namespace BufferCache {
+
+    // how much memory we use, 1/64 of it
+    constexpr uint32_t MEMORY_SHARE = 64;
+
+    constexpr uint32_t MIN_BUFFERS = 64;
+
+    struct Bucket {
+        InterruptSafeLock lock;
+        Buffer* first = nullptr;
+    };
+
+    // Allocated in init(), the global constructors that use the cache
+    // might run before ours
+    struct Cache {
+        uint32_t nBuckets;
+        Bucket* buckets;
+
+        // protects the LRU list, nBuffers and spare
+        InterruptSafeLock lru_lock{};
+        Buffer* lru_first = nullptr;     // least recently used
+        Buffer* lru_last = nullptr;
+        uint32_t nBuffers = 0;
+        uint32_t maxBuffers;
+        Buffer* spare = nullptr;         // lost a race in get(), not hashed
+
+        Atomic<uint32_t> hits{0};
+        Atomic<uint32_t> misses{0};
+        Atomic<uint32_t> evictions{0};
+        Atomic<uint32_t> bypassed{0};
+
+        Cache(uint32_t maxBuffers, uint32_t nBuckets) : nBuckets(nBuckets), buckets(new Bucket[nBuckets]),
+            maxBuffers(maxBuffers) {}
+    };
+
+    static Cache* cache = nullptr;
+
+    void init() {
+        auto maxBuffers = K::max(kConfig.memSize / MEMORY_SHARE / BLOCK_SIZE, MIN_BUFFERS);
+        // about 4 buffers per chain when full
+        uint32_t nBuckets = 16;
+        while (nBuckets * 4 < maxBuffers) nBuckets *= 2;
+        cache = new Cache(maxBuffers, nBuckets);
+        Debug::printf("| buffer cache: %d buffers, %d buckets\n",maxBuffers,nBuckets);
+    }
+
+    static Bucket& bucket(const void* device, uint32_t block) {
+        uint32_t h = (block * 2654435761u) ^ (uint32_t(device) >> 4);
+        return cache->buckets[(h ^ (h >> 16)) & (cache->nBuckets - 1)];
+    }
+
+    // The caller holds the LRU lock
+    static void lru_remove(Buffer* b) {
+        if (b->lru_prev == nullptr) {
+            cache->lru_first = b->lru_next;
+        } else {
+            b->lru_prev->lru_next = b->lru_next;
+        }
+        if (b->lru_next == nullptr) {
+            cache->lru_last = b->lru_prev;
+        } else {
+            b->lru_next->lru_prev = b->lru_prev;
+        }
+        b->on_lru = false;
+    }
+
+    // A buffer nobody can find: a spare one, a new one, or the least
+    // recently used one taken out of its chain. nullptr if all are pinned
+    static Buffer* take() {
+        bool grow = false;
+        {
+            LockGuard g{cache->lru_lock};
+            if (cache->spare != nullptr) {
+                auto b = cache->spare;
+                cache->spare = nullptr;
+                return b;
+            }
+            if (cache->nBuffers < cache->maxBuffers) {
+                cache->nBuffers += 1;
+                grow = true;
+            }
+        }
+        if (grow) {
+            auto b = new Buffer();
+            b->data = new char[BLOCK_SIZE];
+            return b;
+        }
+
+        while (true) {
+            const void* device;
+            uint32_t block;
+            Buffer* victim;
+            {
+                LockGuard g{cache->lru_lock};
+                victim = cache->lru_first;
+                if (victim == nullptr) return nullptr;
+                device = victim->device;
+                block = victim->block;
+            }
+
+            // bucket locks come before the LRU lock, look again once we
+            // have both
+            auto& bk = bucket(device,block);
+            LockGuard g1{bk.lock};
+            LockGuard g2{cache->lru_lock};
+            if (!victim->on_lru || victim->refs != 0 || victim->device != device || victim->block != block) {
+                continue;
+            }
+            lru_remove(victim);
+            Buffer* prev = nullptr;
+            for (auto b = bk.first; b != victim; b = b->hash_next) {
+                ASSERT(b != nullptr);
+                prev = b;
+            }
+            if (prev == nullptr) {
+                bk.first = victim->hash_next;
+            } else {
+                prev->hash_next = victim->hash_next;
+            }
+            victim->hash_next = nullptr;
+            cache->evictions.add_fetch(1);
+            return victim;
+        }
+    }
+
+    // The caller holds the bucket lock
+    static Buffer* find(Bucket& bk, const void* device, uint32_t block) {
+        for (auto b = bk.first; b != nullptr; b = b->hash_next) {
+            if (b->device == device && b->block == block) {
+                b->refs += 1;
+                if (b->refs == 1) {
+                    LockGuard g{cache->lru_lock};
+                    if (b->on_lru) lru_remove(b);
+                }
+                return b;
+            }
+        }
+        return nullptr;
+    }
+
+    static Buffer* wait_for(Buffer* b, bool wait) {
+        while (wait && !b->valid.get()) yield();
+        return b;
+    }
+
+    Buffer* get(const void* device, uint32_t block, bool& fill, bool wait) {
+        fill = false;
+        if (cache == nullptr) return nullptr;
+
+        auto& bk = bucket(device,block);
+        Buffer* b;
+        {
+            LockGuard g{bk.lock};
+            b = find(bk,device,block);
+        }
+        if (b != nullptr) {
+            cache->hits.add_fetch(1);
+            return wait_for(b,wait);
+        }
+
+        auto fresh = take();
+        if (fresh == nullptr) {
+            cache->bypassed.add_fetch(1);
+            return nullptr;
+        }
+        fresh->device = device;
+        fresh->block = block;
+        fresh->refs = 1;
+        fresh->valid.set(false);
+
+        {
+            LockGuard g{bk.lock};
+            b = find(bk,device,block);
+            if (b == nullptr) {
+                fresh->hash_next = bk.first;
+                bk.first = fresh;
+                cache->misses.add_fetch(1);
+                fill = true;
+                return fresh;
+            }
+        }
+
+        // somebody else brought it in while we were looking for a buffer
+        {
+            LockGuard g{cache->lru_lock};
+            if (cache->spare == nullptr) {
+                cache->spare = fresh;
+                fresh = nullptr;
+            } else {
+                cache->nBuffers -= 1;
+            }
+        }
+        if (fresh != nullptr) {
+            // can't happen often, give it up
+            delete[] fresh->data;
+            delete fresh;
+        }
+        cache->hits.add_fetch(1);
+        return wait_for(b,wait);
+    }
+
+    void ready(Buffer* b) {
+        b->valid.set(true);
+    }
+
+    void release(Buffer* b) {
+        auto& bk = bucket(b->device,b->block);
+        LockGuard g{bk.lock};
+        ASSERT(b->refs > 0);
+        b->refs -= 1;
+        if (b->refs == 0) {
+            LockGuard g2{cache->lru_lock};
+            b->lru_next = nullptr;
+            b->lru_prev = cache->lru_last;
+            if (cache->lru_last == nullptr) {
+                cache->lru_first = b;
+            } else {
+                cache->lru_last->lru_next = b;
+            }
+            cache->lru_last = b;
+            b->on_lru = true;
+        }
+    }
+
+    void stats() {
+        if (cache == nullptr) return;
+        uint32_t hits = cache->hits;
+        uint32_t misses = cache->misses;
+        uint32_t total = hits + misses;
+        // no 64 bit division in here
+        uint32_t percent = (total == 0) ? 0 : (total < (1 << 24)) ? hits * 100 / total : hits / (total / 100);
+        Debug::printf("| buffer cache: %d/%d buffers, %d hits, %d misses (%d%% hits), %d evictions, %d bypassed\n",
+            cache->nBuffers,cache->maxBuffers,hits,misses,
+            percent,
+            uint32_t(cache->evictions),uint32_t(cache->bypassed));
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef _buffer_cache_h_
+#define _buffer_cache_h_
+
+#include "stdint.h"
+#include "atomic.h"
+
+// A cache of device blocks (disk sectors) shared by all the devices
+// that want one.
+//
+// Buffers are found by hashing (device, block). Each hash bucket has a
+// lock of its own. A buffer is pinned while somebody holds a reference.
+// Unpinned buffers are kept on an LRU list, and the oldest one is reused
+// when the cache is full. The cache takes 1/64 of memory.
+//
+// A device calls get() and then copies the data out or in. If get()
+// says fill, the caller reads the block into the buffer and calls
+// ready(). Other callers that want the same block wait until then.
+//
+namespace BufferCache {
+
+    constexpr uint32_t BLOCK_SIZE = 512;
+
+    struct Buffer {
+        const void* device;
+        uint32_t block;
+        char* data;
+        uint32_t refs;           // protected by the bucket lock
+        Atomic<bool> valid;
+        bool on_lru;             // protected by the LRU lock
+        Buffer* hash_next;
+        Buffer* lru_prev;
+        Buffer* lru_next;
+
+        Buffer() : device(nullptr), block(0), data(nullptr), refs(0), valid(false),
+            on_lru(false), hash_next(nullptr), lru_prev(nullptr), lru_next(nullptr) {}
+    };
+
+    // Called once, before the global constructors open the root file system
+    void init();
+
+    // Returns the pinned buffer for the given block. fill is set if it
+    // wasn't cached, the caller has to fill it and call ready(). Returns
+    // nullptr if every buffer is pinned, the caller goes to the device.
+    // With wait = false a buffer somebody else is still filling comes
+    // back not valid (for callers holding buffers of their own)
+    Buffer* get(const void* device, uint32_t block, bool& fill, bool wait = true);
+
+    // The buffer has its data
+    void ready(Buffer* b);
+
+    // Drop the reference from get()
+    void release(Buffer* b);
+
+    // Hits, misses and evictions
+    void stats();
+}
+
+#endif
@@ -55,8 +55,18 @@ gheith_contextSwitch:
     // Now we can restore the target context, interrupts still disabled
     mov 28(%ecx),%edi
     mov %edi,%cr2
+
+    // Loading %cr3 flushes the TLB, skip it when we can:
+    //     - cr3 == 0: a kernel-only thread, it borrows whatever is loaded
+    //     - same address space as the one we have
     mov 32(%ecx),%edi
+    test %edi,%edi
+    jz 1f
+    mov %cr3,%esi
+    cmp %esi,%edi
+    je 1f
     mov %edi,%cr3
+1:
     
     mov 0(%ecx),%ebx
     mov 4(%ecx),%esp
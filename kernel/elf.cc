@@ -2,6 +2,7 @@
 #include "machine.h"
 #include "debug.h"
 #include "vmm.h"
+#include "physmem.h"
 
 uint32_t ELF::load(Shared<Node> file) {
     ElfHeader hdr;
@@ -24,9 +25,20 @@ uint32_t ELF::load(Shared<Node> file) {
 
             Debug::printf("vaddr:%x memsz:0x%x filesz:0x%x fileoff:%x\n",
                 p,memsz,filesz,phdr.offset);
-            VMM::mmap(p, memsz, 0xa, 0x1, -1, phdr.offset);
-            file->read_all(phdr.offset,filesz,p);
-            bzero(p + filesz, memsz - filesz);
+
+            // Demand paged: a private mapping of the file, the pages come
+            // from the page cache (shared by everybody running this program
+            // until they write to them) and the bss reads as zeros.
+            uint32_t start = PhysMem::framedown(phdr.vaddr);
+            uint32_t skip = phdr.vaddr - start;
+            if (phdr.offset >= skip) {
+                VMM::mmap_node((void*) start, skip + memsz, 0xa, 0x2, file, phdr.offset - skip, skip + filesz);
+            } else {
+                // no file offset lines up with the start of the page
+                VMM::mmap((void*) start, skip + memsz, 0xa, 0, -1, 0);
+                file->read_all(phdr.offset,filesz,p);
+                bzero(p + filesz, memsz - filesz);
+            }
         }
     }
 
@@ -1,5 +1,6 @@
 #include "ext2.h"
 #include "libk.h"
+#include "machine.h"
 
 #if 0
 template <typename T>
@@ -135,26 +136,246 @@ void Node::get_symbol(char* buffer) {
     }
 }
 
-void Node::read_block(uint32_t index, char* buffer) {
-    ASSERT(index < data.n_sectors / (block_size / 512));
+uint32_t Node::map_ref(uint32_t height, uint32_t block, uint32_t i) {
+    // a hole covers everything under it
+    if (block == 0) return 0;
+
+    bool mine = false;
+    uint32_t* refs;
+    {
+        LockGuard g{map_lock};
+        auto& c = map_cache[height];
+        if (c.block == block) return c.refs[i];
+        if (!c.loading) {
+            c.loading = true;
+            c.block = 0;
+            mine = true;
+        }
+        refs = c.refs;
+    }
 
-    auto refs_per_block = block_size / 4;
+    if (!mine) {
+        // somebody else is filling the slot, read just the one entry
+        uint32_t out;
+        auto cnt = ide->read_all(block * block_size + i * 4, 4, (char*) &out);
+        ASSERT(cnt == 4);
+        return out;
+    }
+
+    // the slot is ours until we clear loading, fill it without the lock
+    if (refs == nullptr) refs = new uint32_t[block_size / 4];
+    auto cnt = ide->read_all(block * block_size, block_size, (char*) refs);
+    ASSERT(cnt == block_size);
+    auto out = refs[i];
+
+    LockGuard g{map_lock};
+    auto& c = map_cache[height];
+    c.refs = refs;
+    c.block = block;
+    c.loading = false;
+    return out;
+}
 
-    uint32_t block_index;
+uint32_t Node::block_index(uint32_t index) {
+    ASSERT(index < size_in_blocks());
+
+    auto refs_per_block = block_size / 4;
 
     if (index < 12) {
         uint32_t* direct = &data.direct0;
-        block_index = direct[index];
-    } else if (index < (12 + refs_per_block)) {
-        ide->read(data.indirect_1 * block_size + (index - 12) * 4,block_index);
+        return direct[index];
+    }
+    index -= 12;
 
-    } else {
-        block_index = 0;
-        Debug::panic("index = %d\n",index);
+    if (index < refs_per_block) {
+        return map_ref(0, data.indirect_1, index);
+    }
+    index -= refs_per_block;
+
+    auto refs_per_double = refs_per_block * refs_per_block;
+    if (index < refs_per_double) {
+        auto leaf = map_ref(1, data.indirect_2, index / refs_per_block);
+        return map_ref(0, leaf, index % refs_per_block);
+    }
+    index -= refs_per_double;
+
+    ASSERT(index / refs_per_double < refs_per_block);
+    auto middle = map_ref(2, data.indirect_3, index / refs_per_double);
+    auto leaf = map_ref(1, middle, (index / refs_per_block) % refs_per_block);
+    return map_ref(0, leaf, index % refs_per_block);
+}
+
+void Node::read_block(uint32_t index, char* buffer) {
+    read_blocks(index, 1, buffer);
+}
+
+void Node::read_blocks(uint32_t start, const IOVec* vec, uint32_t n) {
+    auto sectors = block_size / ide->block_size;
+
+    // the device request we are building
+    constexpr uint32_t RUN = 16;
+    IOVec run[RUN];
+    uint32_t m = 0;
+    uint32_t first = 0;     // device block
+    uint32_t next = 0;
+
+    auto flush = [&] {
+        if (m > 0) {
+            ide->read_blocks(first * sectors, run, m);
+            m = 0;
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        ASSERT(vec[i].bytes % block_size == 0);
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            auto to = vec[i].buffer + off;
+            auto block = block_index(start++);
+            if (block == 0) {
+                bzero(to, block_size);
+                continue;
+            }
+            if (m > 0 && block == next) {
+                auto& last = run[m - 1];
+                if (last.buffer + last.bytes == to) {
+                    last.bytes += block_size;
+                    next += 1;
+                    continue;
+                }
+                if (m < RUN) {
+                    run[m].buffer = to;
+                    run[m].bytes = block_size;
+                    m += 1;
+                    next += 1;
+                    continue;
+                }
+            }
+            flush();
+            run[0].buffer = to;
+            run[0].bytes = block_size;
+            m = 1;
+            first = block;
+            next = block + 1;
+        }
     }
+    flush();
+}
 
-    auto cnt = ide->read_all(block_index * block_size, block_size,buffer);
+void Node::read_blocks_async(uint32_t start, const IOVec* vec, uint32_t n, Completion* done) {
+    auto sectors = block_size / ide->block_size;
+    auto join = new Join(done);
+
+    // the device request we are building, like read_blocks
+    constexpr uint32_t RUN = 16;
+    IOVec run[RUN];
+    uint32_t m = 0;
+    uint32_t first = 0;     // device block
+    uint32_t next = 0;
+
+    auto flush = [&] {
+        if (m > 0) {
+            ide->read_blocks_async(first * sectors, run, m, join->add());
+            m = 0;
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        ASSERT(vec[i].bytes % block_size == 0);
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            auto to = vec[i].buffer + off;
+            auto block = block_index(start++);
+            if (block == 0) {
+                bzero(to, block_size);
+                continue;
+            }
+            if (m > 0 && block == next) {
+                auto& last = run[m - 1];
+                if (last.buffer + last.bytes == to) {
+                    last.bytes += block_size;
+                    next += 1;
+                    continue;
+                }
+                if (m < RUN) {
+                    run[m].buffer = to;
+                    run[m].bytes = block_size;
+                    m += 1;
+                    next += 1;
+                    continue;
+                }
+            }
+            flush();
+            run[0].buffer = to;
+            run[0].bytes = block_size;
+            m = 1;
+            first = block;
+            next = block + 1;
+        }
+    }
+    flush();
+    join->complete();
+}
+
+bool Node::write_block(uint32_t index, const char* buffer) {
+    auto block = block_index(index);
+    // we don't allocate blocks
+    if (block == 0) return false;
+    auto cnt = ide->write_all(block * block_size, block_size,buffer);
     ASSERT(cnt == block_size);
+    return true;
+}
+
+bool Node::write_blocks(uint32_t start, const IOVec* vec, uint32_t n) {
+    auto sectors = block_size / ide->block_size;
+
+    // the device request we are building, like read_blocks
+    constexpr uint32_t RUN = 16;
+    IOVec run[RUN];
+    uint32_t m = 0;
+    uint32_t first = 0;     // device block
+    uint32_t next = 0;
+    bool ok = true;
+
+    auto flush = [&] {
+        if (m > 0) {
+            ide->write_blocks(first * sectors, run, m);
+            m = 0;
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        ASSERT(vec[i].bytes % block_size == 0);
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            auto from = vec[i].buffer + off;
+            auto block = block_index(start++);
+            if (block == 0) {
+                ok = false;
+                continue;
+            }
+            if (m > 0 && block == next) {
+                auto& last = run[m - 1];
+                if (last.buffer + last.bytes == from) {
+                    last.bytes += block_size;
+                    next += 1;
+                    continue;
+                }
+                if (m < RUN) {
+                    run[m].buffer = from;
+                    run[m].bytes = block_size;
+                    m += 1;
+                    next += 1;
+                    continue;
+                }
+            }
+            flush();
+            run[0].buffer = from;
+            run[0].bytes = block_size;
+            m = 1;
+            first = block;
+            next = block + 1;
+        }
+    }
+    flush();
+    return ok;
 }
 
 uint32_t Node::find(const char* name) {
@@ -114,6 +114,24 @@ class Node : public BlockIO { // we implement BlockIO because we
     Shared<Ide> ide;
     Atomic<uint32_t> ref_count;
 
+    // The indirect blocks we decoded last, by height in the tree:
+    // 0 -> points at data blocks, 1 -> at those, 2 -> at those. A
+    // sequential read finds its next mapping here without any I/O
+    struct MapCache {
+        uint32_t block = 0;          // device block, 0 -> nothing cached
+        bool loading = false;        // somebody is reading into refs
+        uint32_t* refs = nullptr;    // allocated once, then reused
+    };
+    MapCache map_cache[3];
+    InterruptSafeLock map_lock;
+
+    // entry i of the given indirect block at the given height
+    uint32_t map_ref(uint32_t height, uint32_t block, uint32_t i);
+
+    // the device block that holds the given block of this node,
+    // 0 for a hole
+    uint32_t block_index(uint32_t index);
+
 public:
 
     // i-number of this node
@@ -124,7 +142,11 @@ public:
 
     }
 
-    virtual ~Node() {}
+    virtual ~Node() {
+        for (auto& c : map_cache) {
+            delete[] c.refs;
+        }
+    }
 
     // How many bytes does this i-node represent
     //    - for a file, the size of the file
@@ -136,8 +158,32 @@ public:
 
     // read the given block (panics if the block number is not valid)
     // remember that block size is defined by the file system not the device
+    // holes (never written blocks) read as zeros
     void read_block(uint32_t number, char* buffer) override;
 
+    // Blocks that follow each other on the disk go to the device as one
+    // request
+    using BlockIO::read_blocks;
+    void read_blocks(uint32_t start, const IOVec* vec, uint32_t n) override;
+
+    // The same device requests, asynchronous ones. Holes are zeroed
+    // before it returns
+    void read_blocks_async(uint32_t start, const IOVec* vec, uint32_t n, Completion* done) override;
+
+    // write the given block in place. Doesn't allocate blocks so
+    // a file never grows past its current size, and returns false for
+    // a hole
+    bool write_block(uint32_t number, const char* buffer) override;
+
+    // Blocks that follow each other on the disk go to the device as one
+    // request, holes are skipped (and make it return false)
+    using BlockIO::write_blocks;
+    bool write_blocks(uint32_t start, const IOVec* vec, uint32_t n) override;
+
+    void sync() override {
+        ide->sync();
+    }
+
     inline uint16_t get_type() {
         return data.get_type();
     }
@@ -6,6 +6,8 @@
 #include "shared.h"
 #include "ext2.h"
 
+class SharedMemory;
+
 class File {
     Atomic<uint32_t> ref_count;
 public:
@@ -18,6 +20,7 @@ public:
     virtual ssize_t read(void* buf, size_t size) = 0;
     virtual ssize_t write(void* buf, size_t size) = 0;
     virtual Shared<Node> getNode() = 0;
+    virtual Shared<SharedMemory> getShm();     // shm_open handles only
 
     friend class Shared<File>;
 };
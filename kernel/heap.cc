@@ -3,8 +3,14 @@
 #include "stdint.h"
 #include "blocking_lock.h"
 #include "atomic.h"
+#include "smp.h"
+#include "machine.h"
+#include "config.h"
+#include "physmem.h"
+#include "libk.h"
 
-/* A first-fit heap */
+/* Size classes with per-CPU caches in front of a first-fit heap that
+   grows with frames from PhysMem */
 
 
 namespace gheith {
@@ -121,6 +127,275 @@ int isAvail(int i) {
 int isTaken(int i) {
     return array[i] < 0;
 }
+
+/*
+ * heapInit gives us a fixed region to boot with. When that runs out we
+ * add chunks of contiguous frames from PhysMem (identity mapped, so we
+ * can use them as they are). Each chunk has its own taken sentinels at
+ * both ends, blocks never merge across chunks, and a chunk that is all
+ * free again goes back to PhysMem. Indexes are still relative to array,
+ * PhysMem's frames are all above the boot region.
+ */
+
+constexpr uint32_t GROW_ORDER = 8;          // 1MB at a time, more for big blocks
+constexpr uint32_t MAX_CHUNKS = 256;        // small ones once memory is fragmented
+
+struct Chunk {
+    int start;          // first int (the sentinel)
+    int end;            // one past the last int
+    uint32_t order;
+};
+
+static Chunk chunks[MAX_CHUNKS];
+static uint32_t nChunks = 0;
+
+// Add a chunk big enough for a block of the given size. Called with
+// theLock held. We don't let PhysMem reclaim for us: the page cache
+// allocates while holding its lock, reclaim would need it again.
+// GROW_ORDER at a time if we can, once memory is too fragmented for
+// that anything down to the smallest run the block fits in.
+bool grow_heap(int ints) {
+    if (nChunks == MAX_CHUNKS) return false;
+    uint32_t need = 0;
+    while ((PhysMem::FRAME_SIZE << need) / 4 < uint32_t(ints + 4)) {
+        if (need == PhysMem::MAX_ORDER) return false;
+        need++;
+    }
+    uint32_t order = K::max(need, GROW_ORDER);
+    uintptr_t pa;
+    while ((pa = PhysMem::alloc_contiguous(order, false)) == 0) {
+        if (order == need) return false;
+        order--;
+    }
+    ASSERT(pa > (uintptr_t) array);
+
+    int start = (pa - (uintptr_t) array) / 4;
+    int n = (PhysMem::FRAME_SIZE << order) / 4;
+    makeTaken(start,2);
+    makeAvail(start+2,n-4);
+    makeTaken(start+n-2,2);
+    if (start + n > len) len = start + n;
+    chunks[nChunks++] = Chunk{start, start + n, order};
+    return true;
+}
+
+// Give the chunk back if the free block [idx,idx+ints) is all of it.
+// Called with theLock held, the block is not on the free list.
+bool shrink_heap(int idx, int ints) {
+    if (array[idx-1] != -2 || array[idx+ints] != -2) return false;
+    for (uint32_t i = 0; i < nChunks; i++) {
+        auto& c = chunks[i];
+        if (c.start + 2 == idx && c.end - 2 == idx + ints) {
+            PhysMem::dealloc_contiguous((uintptr_t) &array[c.start], c.order);
+            chunks[i] = chunks[--nChunks];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Small objects (up to SMALL_MAX bytes) come in power of two size
+ * classes. Each class has a depot: the slabs of the class that have
+ * free objects. A slab is an aligned SLAB_BYTES block from PhysMem, its
+ * first object is the header with the slab's own free list. A slab that
+ * is all free again goes back to PhysMem unless the depot would be left
+ * with less than a slab's worth of free objects. In front of the depots
+ * every core has a cache of objects per class that only it touches
+ * (with interrupts disabled), so most allocations and frees take no
+ * lock at all. The cache goes to the depot CACHE_BATCH objects at a
+ * time. Until PhysMem is up small objects come from the first-fit heap.
+ */
+
+constexpr uint32_t NCLASSES = 8;                    // 16 ... 2048 bytes
+constexpr uint32_t MIN_SHIFT = 4;
+constexpr uint32_t SMALL_MAX = 1 << (MIN_SHIFT + NCLASSES - 1);
+constexpr uint32_t SLAB_ORDER = 2;
+constexpr uint32_t SLAB_BYTES = PhysMem::FRAME_SIZE << SLAB_ORDER;
+constexpr uint32_t PAGE = 4096;
+constexpr uint32_t CACHE_SIZE = 32;
+constexpr uint32_t CACHE_BATCH = 16;
+
+struct FreeObject {
+    FreeObject* next;
+};
+
+struct Slab {
+    Slab* next;             // on the depot's list while it has free objects
+    Slab* prev;
+    FreeObject* first;
+    uint32_t free;
+};
+
+struct Depot {
+    SpinLock lock{};
+    Slab* partial = nullptr;
+    uint32_t count = 0;     // free objects in all of the slabs
+};
+
+struct Cache {
+    uint32_t count[NCLASSES];
+    void* objects[NCLASSES][CACHE_SIZE];
+};
+
+// all of them come from the first-fit heap in heapInit, nothing here
+// can rely on global constructors
+static Depot* depots = nullptr;
+static PerCPU<Cache>* caches = nullptr;
+static SpinLock* sample_lock = nullptr;     // the profiler's
+static bool use_caches = false;
+
+// one byte per heap page: 0 for first-fit memory, class + 1 for slabs
+static uint8_t* page_class = nullptr;
+
+void* first_fit_malloc(size_t bytes);
+
+uint32_t class_of(size_t bytes) {
+    uint32_t c = 0;
+    while ((uint32_t(1) << (MIN_SHIFT + c)) < bytes) c++;
+    return c;
+}
+
+// objects in a slab of class c, the header takes the first one
+uint32_t slab_objects(uint32_t c) {
+    return (SLAB_BYTES >> (MIN_SHIFT + c)) - 1;
+}
+
+void set_class(uintptr_t slab, uint8_t value) {
+    auto first_page = (slab - (uintptr_t) array) / PAGE;
+    for (uint32_t i = 0; i < SLAB_BYTES / PAGE; i++) {
+        page_class[first_page + i] = value;
+    }
+}
+
+void link(Depot& d, Slab* s) {
+    s->prev = nullptr;
+    s->next = d.partial;
+    if (d.partial != nullptr) d.partial->prev = s;
+    d.partial = s;
+}
+
+void unlink(Depot& d, Slab* s) {
+    if (s->prev == nullptr) d.partial = s->next; else s->prev->next = s->next;
+    if (s->next != nullptr) s->next->prev = s->prev;
+}
+
+// Add a new slab to the depot of class c. Returns false if PhysMem has
+// nothing for us (or isn't up yet).
+bool grow(uint32_t c) {
+    auto pa = PhysMem::alloc_contiguous(SLAB_ORDER, false);
+    if (pa == 0) return false;
+    ASSERT(pa > (uintptr_t) array);
+    set_class(pa, c + 1);
+
+    uint32_t size = 1 << (MIN_SHIFT + c);
+    auto s = (Slab*) pa;
+    s->first = nullptr;
+    s->free = slab_objects(c);
+    for (uint32_t off = SLAB_BYTES - size; off != 0; off -= size) {
+        auto o = (FreeObject*) (pa + off);
+        o->next = s->first;
+        s->first = o;
+    }
+
+    auto& d = depots[c];
+    LockGuard g{d.lock};
+    link(d, s);
+    d.count += s->free;
+    return true;
+}
+
+// Move up to n objects from the depot to out. Returns how many.
+uint32_t depot_take(uint32_t c, void** out, uint32_t n) {
+    auto& d = depots[c];
+    LockGuard g{d.lock};
+    uint32_t got = 0;
+    while (got < n && d.partial != nullptr) {
+        auto s = d.partial;
+        while (got < n && s->first != nullptr) {
+            auto o = s->first;
+            s->first = o->next;
+            s->free--;
+            out[got++] = o;
+        }
+        if (s->free == 0) unlink(d, s);
+    }
+    d.count -= got;
+    return got;
+}
+
+// n is at most CACHE_BATCH
+void depot_put(uint32_t c, void* const* objects, uint32_t n) {
+    auto& d = depots[c];
+    auto per_slab = slab_objects(c);
+    Slab* empty[CACHE_BATCH];
+    uint32_t nEmpty = 0;
+    {
+        LockGuard g{d.lock};
+        for (uint32_t i = 0; i < n; i++) {
+            auto o = (FreeObject*) objects[i];
+            auto s = (Slab*) ((uintptr_t) o & ~(SLAB_BYTES - 1));
+            o->next = s->first;
+            s->first = o;
+            if (s->free++ == 0) link(d, s);
+            d.count++;
+            if (s->free == per_slab && d.count >= 2 * per_slab) {
+                unlink(d, s);
+                d.count -= per_slab;
+                empty[nEmpty++] = s;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < nEmpty; i++) {
+        set_class((uintptr_t) empty[i], 0);
+        PhysMem::dealloc_contiguous((uintptr_t) empty[i], SLAB_ORDER);
+    }
+}
+
+void* small_malloc(uint32_t c) {
+    while (true) {
+        void* p = nullptr;
+        if (use_caches) {
+            auto was = Interrupts::disable();
+            auto& cache = caches->mine();
+            auto& count = cache.count[c];
+            if (count == 0) {
+                count = depot_take(c, cache.objects[c], CACHE_BATCH);
+            }
+            if (count != 0) p = cache.objects[c][--count];
+            Interrupts::restore(was);
+        } else {
+            depot_take(c, &p, 1);
+        }
+        if (p != nullptr) return p;
+
+        // the depot is empty too
+        if (!grow(c)) return nullptr;
+    }
+}
+
+void small_free(uint32_t c, void* p) {
+    if (safe && ((uintptr_t) p & ((1 << (MIN_SHIFT + c)) - 1)) != 0) {
+        Debug::panic("freeing a bad pointer %x\n",(uint32_t) p);
+    }
+    if (!use_caches) {
+        depot_put(c, &p, 1);
+        return;
+    }
+    auto was = Interrupts::disable();
+    auto& cache = caches->mine();
+    auto& count = cache.count[c];
+    if (count == CACHE_SIZE) {
+        // keep the newest ones, they are likely still in this core's cache
+        depot_put(c, cache.objects[c], CACHE_BATCH);
+        for (uint32_t i = CACHE_BATCH; i < CACHE_SIZE; i++) {
+            cache.objects[c][i - CACHE_BATCH] = cache.objects[c][i];
+        }
+        count -= CACHE_BATCH;
+    }
+    cache.objects[c][count++] = p;
+    Interrupts::restore(was);
+}
 };
 
 void heapInit(void* base, size_t bytes) {
@@ -135,13 +410,25 @@ void heapInit(void* base, size_t bytes) {
     makeAvail(2,len-4);
     makeTaken(len-2,2);
     theLock = new BlockingLock();
+
+    // while depots is null these go to the first-fit heap
+    // chunks can come from anywhere in physical memory
+    auto pages = (kConfig.memSize - (uint32_t) base) / PAGE;
+    page_class = new uint8_t[pages];
+    bzero(page_class, pages);
+    caches = new PerCPU<Cache>;
+    bzero(caches, sizeof(PerCPU<Cache>));
+    depots = new Depot[NCLASSES];
+    sample_lock = new SpinLock();
 }
 
-void* malloc(size_t bytes) {
-    using namespace gheith;
-    //Debug::printf("malloc(%d)\n",bytes);
-    if (bytes == 0) return (void*) array;
+void heapEnableCaches() {
+    gheith::use_caches = true;
+}
+
+namespace gheith {
 
+void* first_fit_malloc(size_t bytes) {
     int ints = ((bytes + 3) / 4) + 2;
     if (ints < 4) ints = 4;
 
@@ -152,7 +439,7 @@ void* malloc(size_t bytes) {
     int mx = 0x7FFFFFFF;
     int it = 0;
 
-    {
+    while (true) {
         int countDown = 20;
         int p = avail;
         while (p != 0) {
@@ -171,6 +458,7 @@ void* malloc(size_t bytes) {
             }
             p = next(p);
         }
+        if (it != 0 || !grow_heap(ints)) break;
     }
 
     if (it != 0) {
@@ -188,11 +476,7 @@ void* malloc(size_t bytes) {
     return res;
 }
 
-void free(void* p) {
-    using namespace gheith;
-    if (p == 0) return;
-    if (p == (void*) array) return;
-
+void first_fit_free(void* p) {
     LockGuardP g{theLock};
 
     int idx = ((((uintptr_t) p) - ((uintptr_t) array)) / 4) - 1;
@@ -218,7 +502,193 @@ void free(void* p) {
         sz += size(rightIndex);
     }
 
-    makeAvail(idx,sz);
+    if (!shrink_heap(idx,sz)) {
+        makeAvail(idx,sz);
+    }
+}
+
+/*
+ * Statistics (when STATS is on): bytes in use and their high-water
+ * mark, allocations per size class, and a sampling profiler. Every
+ * SAMPLE_EVERY-th allocation remembers its call site and stays in the
+ * samples table until it is freed, so the sites with the most live
+ * samples are the ones holding on to memory (or leaking it). They cost
+ * a few atomics on every malloc and free, build with -DHEAP_STATS=1
+ * (make HEAP_STATS=1) to turn them on.
+ */
+
+#ifndef HEAP_STATS
+#define HEAP_STATS 0
+#endif
+
+constexpr bool STATS = HEAP_STATS;
+constexpr uint32_t SAMPLE_EVERY = 64;
+constexpr uint32_t NSITES = 64;
+constexpr uint32_t NSAMPLES = 1024;     // direct mapped by address
+
+static uint32_t in_use = 0;
+static uint32_t high_water = 0;
+static uint32_t class_allocs[NCLASSES + 1];    // the last one is first-fit
+static uint32_t alloc_count = 0;
+
+struct Sample {
+    void* p;
+    uint32_t site;
+    uint32_t bytes;
+};
+
+static HeapSite sites[NSITES];
+static uint32_t nSites = 0;
+static Sample samples[NSAMPLES];
+static uint32_t dropped = 0;           // samples we had no room for
+
+uint32_t sample_slot(void* p) {
+    return ((uintptr_t) p >> MIN_SHIFT) % NSAMPLES;
+}
+
+void sample(void* p, uint32_t bytes, void* pc) {
+    LockGuardP g{sample_lock};
+    auto& s = samples[sample_slot(p)];
+    uint32_t i = 0;
+    while (i < nSites && sites[i].pc != (uint32_t) pc) i++;
+    if (s.p != nullptr || (i == nSites && nSites == NSITES)) {
+        dropped++;
+        return;
+    }
+    if (i == nSites) {
+        sites[nSites++] = HeapSite{(uint32_t) pc, 0, 0, 0};
+    }
+    sites[i].samples++;
+    sites[i].live++;
+    sites[i].live_bytes += bytes;
+    s = Sample{p, i, bytes};
+}
+
+void unsample(void* p) {
+    auto& s = samples[sample_slot(p)];
+    if (__atomic_load_n(&s.p, __ATOMIC_RELAXED) != p) return;
+    LockGuardP g{sample_lock};
+    if (s.p != p) return;
+    sites[s.site].live--;
+    sites[s.site].live_bytes -= s.bytes;
+    s.p = nullptr;
+}
+
+uint32_t block_bytes(void* p) {
+    return size((((uintptr_t) p - (uintptr_t) array) / 4) - 1) * 4;
+}
+
+void* allocate(size_t bytes, void* pc) {
+    if (bytes == 0) return (void*) array;
+
+    void* p;
+    uint32_t c;
+    p = nullptr;
+    if (bytes <= SMALL_MAX && depots != nullptr) {
+        c = class_of(bytes);
+        p = small_malloc(c);
+    }
+    if (p == nullptr) {
+        c = NCLASSES;
+        p = first_fit_malloc(bytes);
+    }
+    if (!STATS || p == nullptr || sample_lock == nullptr) return p;
+
+    uint32_t got = (c == NCLASSES) ? block_bytes(p) : (1 << (MIN_SHIFT + c));
+    auto now = __atomic_add_fetch(&in_use, got, __ATOMIC_RELAXED);
+    auto high = __atomic_load_n(&high_water, __ATOMIC_RELAXED);
+    while (now > high && !__atomic_compare_exchange_n(&high_water, &high, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&class_allocs[c], 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED) % SAMPLE_EVERY == 0) {
+        sample(p, got, pc);
+    }
+    return p;
+}
+
+}
+
+void* malloc(size_t bytes) {
+    //Debug::printf("malloc(%d)\n",bytes);
+    return gheith::allocate(bytes, __builtin_return_address(0));
+}
+
+void free(void* p) {
+    using namespace gheith;
+    if (p == 0) return;
+    if (p == (void*) array) return;
+
+    auto c = page_class[((uintptr_t) p - (uintptr_t) array) / PAGE];
+    if (STATS && sample_lock != nullptr) {
+        uint32_t got = (c == 0) ? block_bytes(p) : (1 << (MIN_SHIFT + c - 1));
+        __atomic_sub_fetch(&in_use, got, __ATOMIC_RELAXED);
+        unsample(p);
+    }
+    if (c != 0) {
+        small_free(c - 1, p);
+    } else {
+        first_fit_free(p);
+    }
+}
+
+void heapStats(HeapStats& st) {
+    using namespace gheith;
+    bzero(&st, sizeof(st));
+    st.in_use = in_use;
+    st.high_water = high_water;
+    for (uint32_t c = 0; c <= NCLASSES; c++) st.class_allocs[c] = class_allocs[c];
+
+    {
+        LockGuardP g{theLock};
+        for (int p = avail; p != 0; p = next(p)) {
+            st.free_blocks++;
+            st.free_bytes += size(p) * 4;
+            st.largest_free = K::max(st.largest_free, uint32_t(size(p) * 4));
+        }
+        st.chunks = nChunks;
+    }
+    for (uint32_t c = 0; c < NCLASSES; c++) {
+        auto& d = depots[c];
+        LockGuard g{d.lock};
+        st.cached_bytes += d.count << (MIN_SHIFT + c);
+    }
+
+    // the sites holding the most sampled bytes first
+    if (sample_lock == nullptr) return;
+    LockGuardP g{sample_lock};
+    st.dropped = dropped;
+    bool taken[NSITES] = {};
+    for (uint32_t n = 0; n < HeapStats::TOP_SITES && n < nSites; n++) {
+        int best = -1;
+        for (uint32_t i = 0; i < nSites; i++) {
+            if (taken[i]) continue;
+            if (best < 0 || sites[i].live_bytes > sites[best].live_bytes) best = i;
+        }
+        taken[best] = true;
+        st.sites[n] = sites[best];
+        st.nSites++;
+    }
+}
+
+void heapReport() {
+    HeapStats st;
+    heapStats(st);
+    Debug::printf("| heap: %d free blocks with %d bytes, the largest %d, %d bytes in the depots, %d chunks added\n",
+        st.free_blocks, st.free_bytes, st.largest_free, st.cached_bytes, st.chunks);
+    if (!gheith::STATS) {
+        Debug::printf("| heap: no statistics (build with HEAP_STATS=1)\n");
+        return;
+    }
+    Debug::printf("| heap: %d bytes in use, %d at most\n", st.in_use, st.high_water);
+    Debug::printf("| heap allocations by size:");
+    for (uint32_t c = 0; c < HeapStats::CLASSES; c++) {
+        Debug::printf(" %d", st.class_allocs[c]);
+    }
+    Debug::printf(" (16 ... 2048, bigger)\n");
+    Debug::printf("| heap sites (1 in %d allocations sampled, %d dropped):\n", gheith::SAMPLE_EVERY, st.dropped);
+    for (uint32_t i = 0; i < st.nSites; i++) {
+        auto& s = st.sites[i];
+        Debug::printf("|   %x: %d samples, %d live with %d bytes\n", s.pc, s.samples, s.live, s.live_bytes);
+    }
 }
 
 
@@ -227,7 +697,7 @@ void free(void* p) {
 /*****************/
 
 void* operator new(size_t size) {
-    void* p =  malloc(size);
+    void* p = gheith::allocate(size, __builtin_return_address(0));
     if (p == 0) Debug::panic("out of memory");
     return p;
 }
@@ -241,7 +711,7 @@ void operator delete(void* p, size_t sz) {
 }
 
 void* operator new[](size_t size) {
-    void* p =  malloc(size);
+    void* p = gheith::allocate(size, __builtin_return_address(0));
     if (p == 0) Debug::panic("out of memory");
     return p;
 }
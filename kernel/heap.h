@@ -4,6 +4,35 @@
 #include "stdint.h"
 
 extern void heapInit(void* start, size_t bytes);
+extern void heapEnableCaches();     // per-CPU caches, once SMP::me() works
+
+// An allocation site of the sampling profiler
+struct HeapSite {
+    uint32_t pc;            // return address of the malloc/new call
+    uint32_t samples;       // sampled allocations
+    uint32_t live;          // of those, not freed yet
+    uint32_t live_bytes;
+};
+
+struct HeapStats {
+    static constexpr uint32_t CLASSES = 9;     // 16 ... 2048 bytes, bigger
+    static constexpr uint32_t TOP_SITES = 16;
+
+    uint32_t in_use;            // bytes handed out (rounded up)
+    uint32_t high_water;
+    uint32_t free_blocks;       // first-fit free list
+    uint32_t free_bytes;
+    uint32_t largest_free;
+    uint32_t cached_bytes;      // free small objects in the depots
+    uint32_t chunks;            // added from PhysMem
+    uint32_t class_allocs[CLASSES];
+    uint32_t dropped;
+    uint32_t nSites;
+    HeapSite sites[TOP_SITES];  // most live bytes first
+};
+
+extern void heapStats(HeapStats& st);
+extern void heapReport();
 extern "C" void* malloc(size_t size);
 extern "C" void free(void* p);
 
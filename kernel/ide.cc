@@ -5,6 +5,14 @@
 #include "threads.h"
 #include "atomic.h"
 #include "smp.h"
+#include "buffer_cache.h"
+#include "semaphore.h"
+#include "physmem.h"
+#include "idt.h"
+#include "config.h"
+#include "libk.h"
+#include "pit.h"
+#include "process.h"
 
 // The drive number encodes the controller in bit 1 and the channel in bit 0
 
@@ -32,6 +40,19 @@ static inline long getStatus(uint32_t drive) {
     return inb(port(drive) + 7);
 }
 
+// LBA28: up to 256 sectors per command, a count of 0 means 256
+static void issue(uint32_t drive, uint32_t sector, uint32_t count, int command) {
+    int base = port(drive);
+    int ch = channel(drive);
+
+    outb(base + 2, count & 0xff);	// sector count
+    outb(base + 3, sector >> 0);	// bits 7 .. 0
+    outb(base + 4, sector >> 8);	// bits 15 .. 8
+    outb(base + 5, sector >> 16);	// bits 23 .. 16
+    outb(base + 6, 0xE0 | (ch << 4) | ((sector >> 24) & 0xf));
+    outb(base + 7, command);
+}
+
 // Status bits
 #define ERR     0x01
 #define DRQ     0x08
@@ -40,10 +61,6 @@ static inline long getStatus(uint32_t drive) {
 #define DRDY	0x40
 #define BSY	0x80
     
-/* Simple polling PIO interface
-   Need to use interrupts and DMA
- */
-
 static void waitForDrive(uint32_t drive) {
     uint8_t status = getStatus(drive);
     if ((status & (ERR | DF)) != 0) {
@@ -59,98 +76,969 @@ static void waitForDrive(uint32_t drive) {
 
 static uint32_t nRead = 0;
 static uint32_t nWrite = 0;
+static uint32_t nDma = 0;
+static uint32_t nCommands = 0;
+static uint32_t nQueued = 0;
+static uint32_t nMerged = 0;
 
-void Ide::read_block(uint32_t sector, char* buffer) {
-    LockGuard g{lock};
-    uint32_t* ptr = (uint32_t*) buffer;
+using IOVec = BlockIO::IOVec;
+
+// the most we ask for in one command (64KB)
+constexpr uint32_t MAX_SECTORS = Ide::MAX_SECTORS;
+
+// pieces per command, each can take two PRDs (64KB boundary)
+constexpr uint32_t MAX_PIECES = Ide::MAX_PIECES;
+constexpr uint32_t PRD_MAX = 2 * MAX_PIECES;
+
+// the bounce frame holds this many
+constexpr uint32_t BOUNCE_SECTORS = PhysMem::FRAME_SIZE / 512;
+
+// Memory the controller can get at: identity mapped kernel memory.
+// Anything else (user pages) goes through a bounce buffer
+static bool direct(const IOVec* vec, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        auto p = (uint32_t) vec[i].buffer;
+        auto end = p + vec[i].bytes;
+        if (end < p || end > kConfig.memSize || (p & 1) != 0) return false;
+    }
+    return true;
+}
+
+static void gather(char* to, const IOVec* vec, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(to, vec[i].buffer, vec[i].bytes);
+        to += vec[i].bytes;
+    }
+}
+
+static void scatter(const IOVec* vec, uint32_t n, const char* from) {
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(vec[i].buffer, from, vec[i].bytes);
+        from += vec[i].bytes;
+    }
+}
+
+/////////////////////
+// bus master DMA //
+/////////////////////
+
+// The PIIX IDE function on the PCI bus moves the data for us. The
+// drive raises IRQ 14 (first controller) or 15 (second) when it's
+// done and the requesting thread sleeps until then. We fall back to
+// polled PIO when we can't block (interrupts disabled, idle thread,
+// early boot) or when there is no bus master.
+
+// bus master registers, relative to the controller's base
+#define BM_COMMAND  0
+#define BM_STATUS   2
+#define BM_PRD      4
+
+#define BM_START    0x01    // command
+#define BM_READ     0x08    // command: device -> memory
+#define BM_ERROR    0x02    // status, write 1 to clear
+#define BM_IRQ      0x04    // status, write 1 to clear
+
+constexpr uint32_t IDE_VECTOR = 46;
+
+// physical region descriptor, a table of them describes the buffer
+struct PRD {
+    uint32_t pa;
+    uint16_t bytes;
+    uint16_t flags;         // 0x8000 -> last one
+};
+
+// One per controller, the two drives on a controller share the wires
+struct Controller {
+    InterruptSafeLock lock{};   // the registers, and busy
+    uint32_t bm = 0;            // bus master registers, 0 -> PIO only
+    PRD* prd = nullptr;
+    char* bounce = nullptr;     // a frame, so it never crosses 64KB
+    Semaphore* turn = nullptr;  // one DMA request at a time
+    Semaphore* done = nullptr;  // the interrupt handler ups it
+    bool busy = false;          // a DMA transfer is running
+    uint8_t bm_status = 0;      // how the last one ended
+    uint8_t drive_status = 0;
+};
+
+static Controller controllers[2];
+// a table can't cross a 64KB boundary
+static PRD prds[2][PRD_MAX] __attribute__((aligned(PRD_MAX * sizeof(PRD))));
+static bool dmaReady = false;
+
+static uint32_t pciRead(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg) {
+    outl(0xCF8, 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xFC));
+    return inl(0xCFC);
+}
+
+static void pciWrite(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t v) {
+    outl(0xCF8, 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xFC));
+    outl(0xCFC, v);
+}
+
+static void ioapicWrite(uint32_t reg, uint32_t v) {
+    auto base = (volatile uint32_t*) kConfig.ioAPIC;
+    base[0] = reg;
+    base[4] = v;
+}
+
+// The transfer is over, stop the engine and wake up the requester.
+// The caller holds the controller lock
+static void finish(Controller& c, int base) {
+    outb(c.bm + BM_COMMAND, 0);
+    c.bm_status = inb(c.bm + BM_STATUS);
+    c.drive_status = inb(base + 7);     // also acknowledges the interrupt
+    outb(c.bm + BM_STATUS, BM_ERROR | BM_IRQ);
+    c.busy = false;
+    c.done->up();
+}
+
+// PIO and DMA share the registers. The caller holds the controller lock
+// and might not be able to take the interrupt (it could be for this
+// core), so we finish a running DMA transfer ourselves
+static void quiesce(Controller& c, int base) {
+    while (c.busy) {
+        if (inb(c.bm + BM_STATUS) & BM_IRQ) {
+            finish(c, base);
+        } else {
+            pause();
+        }
+    }
+}
+
+extern "C" void ideHandler() {
+    for (int i = 0; i < 2; i++) {
+        auto& c = controllers[i];
+        if (c.bm == 0) continue;
+        LockGuard g{c.lock};
+        if (c.busy) {
+            if (inb(c.bm + BM_STATUS) & BM_IRQ) finish(c, ports[i]);
+        } else {
+            // a PIO command, reading the status acknowledges it
+            inb(ports[i] + 7);
+        }
+    }
+    SMP::eoi();
+}
+
+void Ide::init_dma() {
+    uint32_t bmBase = 0;
+    for (uint32_t dev = 0; dev < 32 && bmBase == 0; dev++) {
+        for (uint32_t func = 0; func < 8; func++) {
+            auto id = pciRead(0, dev, func, 0);
+            if ((id & 0xFFFF) == 0xFFFF) {
+                if (func == 0) break;
+                continue;
+            }
+            auto cls = pciRead(0, dev, func, 8);
+            // mass storage, IDE, bus master capable
+            if ((cls >> 16) != 0x0101 || (cls & 0x8000) == 0) continue;
+            auto bar4 = pciRead(0, dev, func, 0x20);
+            if ((bar4 & 1) == 0) continue;
+            bmBase = bar4 & 0xFFFC;
+            // I/O space and bus master enable
+            pciWrite(0, dev, func, 4, pciRead(0, dev, func, 4) | 0x5);
+            Debug::printf("| ide: bus master at 0x%x (pci %d.%d, id %x)\n",bmBase,dev,func,id);
+            break;
+        }
+    }
+    if (bmBase == 0) {
+        Debug::printf("| ide: no bus master, using PIO\n");
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        auto& c = controllers[i];
+        c.prd = prds[i];
+        c.bounce = (char*) PhysMem::alloc_frame(false);
+        c.turn = new Semaphore(1);
+        c.done = new Semaphore(0);
+        c.bm = bmBase + 8 * i;
+        outb(ports[i] + 0x206, 0);      // device control: nIEN = 0
+    }
+
+    // the old PICs stay quiet, IRQ 14 and 15 go through the IO APIC to
+    // this core. Edge triggered, active high, the ISA defaults
+    outb(0x21, 0xff);
+    outb(0xa1, 0xff);
+    IDT::interrupt(IDE_VECTOR, (uint32_t) ideHandler_);
+    for (uint32_t irq = 14; irq <= 15; irq++) {
+        ioapicWrite(0x10 + 2 * irq + 1, SMP::me() << 24);
+        ioapicWrite(0x10 + 2 * irq, IDE_VECTOR);
+    }
+    dmaReady = true;
+}
+
+bool Ide::dma(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n, bool write, char* cached_copy) {
+    if (!dmaReady || Interrupts::isDisabled()) return false;
+    auto& c = controllers[controller(drive)];
+    if (c.bm == 0 || gheith::current()->isIdle) return false;
+
+    bool bounce = !direct(vec, n);
+    ASSERT(!bounce || count <= BOUNCE_SECTORS);
+    uint8_t direction = write ? 0 : BM_READ;
+
+    c.turn->down();
+    // the one before us might have hit an error and turned DMA off
+    if (c.bm == 0) {
+        c.turn->up();
+        return false;
+    }
+    if (bounce && write) gather(c.bounce, vec, n);
+    {
+        LockGuard g{c.lock};
+
+        nDma += 1;
+        waitForDrive(drive);
+
+        uint32_t m = 0;
+        if (bounce) {
+            c.prd[0].pa = (uint32_t) c.bounce;
+            c.prd[0].bytes = count * block_size;
+            c.prd[0].flags = 0;
+            m = 1;
+        } else {
+            for (uint32_t i = 0; i < n; i++) {
+                auto pa = (uint32_t) vec[i].buffer;
+                auto left = vec[i].bytes;
+                while (left > 0) {
+                    auto bytes = K::min(left, 0x10000 - (pa & 0xFFFF));
+                    ASSERT(m < PRD_MAX);
+                    c.prd[m].pa = pa;
+                    c.prd[m].bytes = bytes & 0xFFFF;    // 0 -> 64KB
+                    c.prd[m].flags = 0;
+                    m += 1;
+                    pa += bytes;
+                    left -= bytes;
+                }
+            }
+        }
+        c.prd[m - 1].flags = 0x8000;
+        outl(c.bm + BM_PRD, (uint32_t) c.prd);
+        outb(c.bm + BM_COMMAND, direction);
+        outb(c.bm + BM_STATUS, BM_ERROR | BM_IRQ);
+
+        issue(drive, sector, count, write ? 0xCA : 0xC8);	// write/read DMA
+
+        c.busy = true;
+        outb(c.bm + BM_COMMAND, direction | BM_START);
+    }
+    c.done->down();
+
+    bool ok = ((c.bm_status & BM_ERROR) == 0) && ((c.drive_status & (ERR | DF)) == 0);
+    if (ok) {
+        if (bounce && !write) scatter(vec, n, c.bounce);
+        if (cached_copy != nullptr) memcpy(cached_copy, vec[0].buffer, block_size);
+    } else {
+        Debug::printf("| ide: DMA error on drive %d, bm status 0x%x, status 0x%x, back to PIO\n",
+            drive,c.bm_status,c.drive_status);
+        c.bm = 0;
+    }
+    c.turn->up();
+    return ok;
+}
+
+///////////////////
+// request queue //
+///////////////////
+
+// Every drive has a queue of requests and a thread that feeds them to
+// the controller one (merged) command at a time. The order is:
+//
+//   - the oldest request past its deadline, nothing waits forever
+//   - a process that got QUANTUM commands in a row steps aside while
+//     somebody else is waiting, so a long sequential read can't keep
+//     the head to itself
+//   - otherwise C-SCAN: the lowest sector at or after the end of the
+//     last transfer, wrapping around to the lowest one
+//
+// Queued requests for the sectors right before or after the chosen one
+// go out with it as one command, each still completes on its own.
+
+// in jiffies (ms), reads have somebody waiting for them
+constexpr uint32_t READ_DEADLINE = 50;
+constexpr uint32_t WRITE_DEADLINE = 500;
+
+constexpr uint32_t QUANTUM = 8;
+
+using Request = Ide::Request;
+
+struct DriveQueue {
+    InterruptSafeLock lock{};
+    Request* first = nullptr;           // in arrival order
+    Request* last = nullptr;
+    Semaphore* pending = nullptr;       // up once per request
+
+    // only the queue thread looks at these
+    uint32_t head = 0;                  // where the last transfer ended
+    const void* last_owner = nullptr;
+    uint32_t streak = 0;                // commands in a row for last_owner
+};
+
+static DriveQueue queues[4];
+static bool queuesReady = false;
+
+// Can this transfer go through the queue and wait there?
+static bool use_queue(uint32_t drive, const IOVec* vec, uint32_t n) {
+    return queuesReady && queues[drive].pending != nullptr && !Interrupts::isDisabled() &&
+        !gheith::current()->isIdle && direct(vec, n);
+}
+
+bool Ide::queued(const IOVec* vec, uint32_t n) {
+    return use_queue(drive, vec, n);
+}
+
+// The caller holds the lock
+static void unlink(DriveQueue& q, Request* r) {
+    Request* prev = nullptr;
+    for (auto p = q.first; p != r; p = p->next) {
+        ASSERT(p != nullptr);
+        prev = p;
+    }
+    if (prev == nullptr) {
+        q.first = r->next;
+    } else {
+        prev->next = r->next;
+    }
+    if (q.last == r) q.last = prev;
+    r->next = nullptr;
+}
+
+// The next request to go, nullptr if there are none. The caller holds
+// the lock
+static Request* pick(DriveQueue& q) {
+    auto now = Pit::jiffies;
+    for (auto r = q.first; r != nullptr; r = r->next) {
+        if (int32_t(now - r->deadline) >= 0) return r;
+    }
+
+    bool others = false;
+    if (q.streak >= QUANTUM) {
+        for (auto r = q.first; r != nullptr; r = r->next) {
+            if (r->owner != q.last_owner) {
+                others = true;
+                break;
+            }
+        }
+    }
+
+    // ties go to the older request, writes to a sector stay in order
+    Request* ahead = nullptr;
+    Request* lowest = nullptr;
+    for (auto r = q.first; r != nullptr; r = r->next) {
+        if (others && r->owner == q.last_owner) continue;
+        if (r->sector >= q.head && (ahead == nullptr || r->sector < ahead->sector)) ahead = r;
+        if (lowest == nullptr || r->sector < lowest->sector) lowest = r;
+    }
+    return (ahead != nullptr) ? ahead : lowest;
+}
+
+// Takes r and the requests it can be merged with out of the queue,
+// in sector order. Returns how many. The caller holds the lock
+static uint32_t take(DriveQueue& q, Request* r, Request** batch) {
+    unlink(q, r);
+    batch[0] = r;
+    uint32_t m = 1;
+    uint32_t start = r->sector;
+    uint32_t end = r->sector + r->count;
+    uint32_t pieces = r->n;
+
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (auto x = q.first; x != nullptr; x = x->next) {
+            if (x->write != r->write || end - start + x->count > MAX_SECTORS || pieces + x->n > MAX_PIECES) continue;
+            if (x->sector == end) {
+                batch[m] = x;
+                end += x->count;
+            } else if (x->sector + x->count == start) {
+                for (uint32_t i = m; i > 0; i--) batch[i] = batch[i - 1];
+                batch[0] = x;
+                start = x->sector;
+            } else {
+                continue;
+            }
+            unlink(q, x);
+            m += 1;
+            pieces += x->n;
+            grew = true;
+            break;
+        }
+    }
+    return m;
+}
+
+void Ide::enqueue(Request* r, uint32_t sector, const IOVec* vec, uint32_t n, bool write) {
+    ASSERT(use_queue(drive, vec, n) && n > 0 && n <= MAX_PIECES);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        ASSERT(vec[i].bytes % block_size == 0);
+        r->vec[i] = vec[i];
+        count += vec[i].bytes / block_size;
+    }
+    ASSERT(count > 0 && count <= MAX_SECTORS);
+
+    r->sector = sector;
+    r->count = count;
+    r->n = n;
+    r->write = write;
+    r->owner = gheith::current()->process.operator->();
+    r->deadline = Pit::jiffies + (write ? WRITE_DEADLINE : READ_DEADLINE);
+    r->next = nullptr;
+
+    auto& q = queues[drive];
+    {
+        LockGuard g{q.lock};
+        if (q.last == nullptr) {
+            q.first = r;
+        } else {
+            q.last->next = r;
+        }
+        q.last = r;
+        nQueued += 1;
+    }
+    q.pending->up();
+}
+
+void Ide::serve(uint32_t drive) {
+    auto& q = queues[drive];
+    Ide disk{drive};
+
+    while (true) {
+        q.pending->down();
+
+        Request* batch[MAX_PIECES];
+        uint32_t m;
+        {
+            LockGuard g{q.lock};
+            auto r = pick(q);
+            // merged with an earlier one
+            if (r == nullptr) continue;
+            m = take(q, r, batch);
+            nMerged += m - 1;
+
+            if (r->owner == q.last_owner) {
+                q.streak += 1;
+            } else {
+                q.last_owner = r->owner;
+                q.streak = 1;
+            }
+        }
+
+        IOVec vec[MAX_PIECES];
+        uint32_t n = 0;
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < m; i++) {
+            for (uint32_t k = 0; k < batch[i]->n; k++) vec[n++] = batch[i]->vec[k];
+            count += batch[i]->count;
+        }
+
+        auto sector = batch[0]->sector;
+        if (batch[0]->write) {
+            disk.write_command(sector, count, vec, n, nullptr);
+        } else {
+            disk.read_command(sector, count, vec, n);
+        }
+        q.head = sector + count;
+
+        for (uint32_t i = 0; i < m; i++) {
+            batch[i]->complete();
+            delete batch[i];
+        }
+    }
+}
+
+void Ide::start_queues() {
+    for (uint32_t drive = 0; drive < 4; drive++) {
+        if (Ide{drive}.identify() == 0) continue;
+        queues[drive].pending = new Semaphore(0);
+        thread(Process::kernelProcess, [drive] {
+            serve(drive);
+        });
+    }
+    queuesReady = true;
+}
+
+void Ide::pio_read(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n) {
+    auto& c = controllers[controller(drive)];
+    LockGuard g{c.lock};
 
-    nRead += 1;
     int base = port(drive);
-    int ch = channel(drive);
+    quiesce(c, base);
 
     waitForDrive(drive);
+    issue(drive, sector, count, 0x20);	// read with retry
 
-    outb(base + 2, 1);			// sector count
-    outb(base + 3, sector >> 0);	// bits 7 .. 0
-    outb(base + 4, sector >> 8);	// bits 15 .. 8
-    outb(base + 5, sector >> 16);	// bits 23 .. 16
-    outb(base + 6, 0xE0 | (ch << 4) | ((sector >> 24) & 0xf));
-    outb(base + 7, 0x20);		// read with retry
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            waitForDrive(drive);
 
-    waitForDrive(drive);
+            while ((getStatus(drive) & DRQ) == 0) {
+                pause();
+            }
 
-    while ((getStatus(drive) & DRQ) == 0) {
-        pause();
+            auto data = (uint32_t*) (vec[i].buffer + off);
+            for (uint32_t k=0; k<block_size/sizeof(uint32_t); k++) {
+                data[k] = inl(base);
+            }
+        }
+    }
+}
+
+void Ide::read_command(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n) {
+    nRead += count;
+    nCommands += 1;
+    if (dma(sector, count, vec, n, false, nullptr)) return;
+
+    if (direct(vec, n)) {
+        pio_read(sector, count, vec, n);
+        return;
     }
 
-    for (uint32_t i=0; i<block_size/sizeof(uint32_t); i++) {
-        ptr[i] = inl(base);
+    // Transfer through a bounce buffer so we never touch the caller's
+    // buffer (possibly a user page that has to be faulted in) while we
+    // hold the lock with interrupts disabled
+    uint32_t data[sector_size / sizeof(uint32_t)];
+    IOVec bounce{(char*) data, block_size};
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            pio_read(sector++, 1, &bounce, 1);
+            memcpy(vec[i].buffer + off, data, block_size);
+        }
+    }
+}
+
+void Ide::read_sectors(uint32_t sector, const IOVec* vec, uint32_t n) {
+    // commands small enough for the bounce frame when we need it. They
+    // all go in the queue before we wait for any of them
+    uint32_t limit = direct(vec, n) ? MAX_SECTORS : BOUNCE_SECTORS;
+    bool queue = use_queue(drive, vec, n);
+    Semaphore finished{0};
+    uint32_t waiting = 0;
+    uint32_t i = 0;
+    uint32_t off = 0;
+    while (i < n) {
+        IOVec part[MAX_PIECES];
+        uint32_t m = 0;
+        uint32_t count = 0;
+        while (i < n && m < MAX_PIECES && count < limit) {
+            auto bytes = K::min(vec[i].bytes - off, (limit - count) * block_size);
+            part[m].buffer = vec[i].buffer + off;
+            part[m].bytes = bytes;
+            m += 1;
+            count += bytes / block_size;
+            off += bytes;
+            if (off == vec[i].bytes) {
+                i += 1;
+                off = 0;
+            }
+        }
+        if (queue) {
+            submit(sector, part, m, false, [&finished] {
+                finished.up();
+            });
+            waiting += 1;
+        } else {
+            read_command(sector, count, part, m);
+        }
+        sector += count;
+    }
+    while (waiting > 0) {
+        finished.down();
+        waiting -= 1;
     }
 }
 
-/*
-void Ide::writeSector(uint32_t sector, const void* buffer) {
-    LockGuard g{lock};
-    const uint32_t* ptr = (const uint32_t*) buffer;
+void Ide::pio_write(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n) {
+    auto& c = controllers[controller(drive)];
+    LockGuard g{c.lock};
 
-    nWrite += 1;
     int base = port(drive);
-    int ch = channel(drive);
+    quiesce(c, base);
 
     waitForDrive(drive);
+    issue(drive, sector, count, 0x30);		// write
 
-    outb(base + 2, 1);			// sector count
-    outb(base + 3, sector >> 0);	// bits 7 .. 0
-    outb(base + 4, sector >> 8);	// bits 15 .. 8
-    outb(base + 5, sector >> 16);	// bits 23 .. 16
-    outb(base + 6, 0xE0 | (ch << 4) | ((sector >> 24) & 0xf));
-    outb(base + 7, 0x30);		// write
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t off = 0; off < vec[i].bytes; off += block_size) {
+            waitForDrive(drive);
+
+            while ((getStatus(drive) & DRQ) == 0) {
+                pause();
+            }
+
+            auto data = (const uint32_t*) (vec[i].buffer + off);
+            for (uint32_t k=0; k<block_size/sizeof(uint32_t); k++) {
+                outl(base,data[k]);
+            }
+        }
+    }
 
     waitForDrive(drive);
+}
 
-    while ((getStatus(drive) & DRQ) == 0) {
-        pause();
+void Ide::write_command(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n, char* cached_copy) {
+    nWrite += count;
+    nCommands += 1;
+    if (dma(sector, count, vec, n, true, cached_copy)) return;
+
+    pio_write(sector, count, vec, n);
+    if (cached_copy != nullptr) {
+        memcpy(cached_copy, vec[0].buffer, block_size);
     }
+}
 
-    for (uint32_t i=0; i<SectorSize/sizeof(uint32_t); i++) {
-        outl(base,ptr[i]);
+void Ide::write_sector(uint32_t sector, const uint32_t* data, char* cached_copy) {
+    IOVec v{(char*) data, block_size};
+    if (!use_queue(drive, &v, 1)) {
+        write_command(sector, 1, &v, 1, cached_copy);
+        return;
     }
 
-    waitForDrive(drive);
+    Semaphore finished{0};
+    submit(sector, &v, 1, true, [&finished, data, cached_copy, this] {
+        // on the queue thread, before the next transfer starts
+        if (cached_copy != nullptr) memcpy(cached_copy, data, block_size);
+        finished.up();
+    });
+    finished.down();
+}
+
+void Ide::read_block(uint32_t sector, char* buffer) {
+    read_blocks(sector, 1, buffer);
+}
+
+// Where the sectors of a scatter-gather request go, one at a time
+struct Cursor {
+    const IOVec* vec;
+    uint32_t i = 0;
+    uint32_t off = 0;
+
+    Cursor(const IOVec* vec) : vec(vec) {}
+
+    char* next(uint32_t bytes) {
+        auto p = vec[i].buffer + off;
+        off += bytes;
+        if (off == vec[i].bytes) {
+            i += 1;
+            off = 0;
+        }
+        return p;
+    }
+};
+
+// Copy the sectors of a write into their cached copies
+static void copy_out(char* const* copies, const IOVec* vec, uint32_t n, uint32_t bytes) {
+    Cursor in{vec};
+    for (uint32_t k = 0; in.i < n; k++) {
+        auto from = in.next(bytes);
+        if (copies[k] != nullptr) memcpy(copies[k], from, bytes);
+    }
+}
 
-    //outb(base + 7, 0xE7); // flush buffers
+void Ide::write_sectors(uint32_t sector, const IOVec* vec, uint32_t n, char* const* copies) {
+    // the same commands read_sectors would make, the caller makes sure
+    // the pieces are direct
+    ASSERT(direct(vec, n));
+    bool queue = use_queue(drive, vec, n);
+    Semaphore finished{0};
+    uint32_t waiting = 0;
+    uint32_t done = 0;
+    uint32_t i = 0;
+    uint32_t off = 0;
+    while (i < n) {
+        IOVec part[MAX_PIECES];
+        uint32_t m = 0;
+        uint32_t count = 0;
+        while (i < n && m < MAX_PIECES && count < MAX_SECTORS) {
+            auto bytes = K::min(vec[i].bytes - off, (MAX_SECTORS - count) * block_size);
+            part[m].buffer = vec[i].buffer + off;
+            part[m].bytes = bytes;
+            m += 1;
+            count += bytes / block_size;
+            off += bytes;
+            if (off == vec[i].bytes) {
+                i += 1;
+                off = 0;
+            }
+        }
+        auto copy = (copies == nullptr) ? nullptr : copies + done;
+        auto bytes = block_size;
+        if (queue) {
+            submit(sector, part, m, true, [&finished, copy, part, m, bytes] {
+                // on the queue thread, before the next transfer starts
+                if (copy != nullptr) copy_out(copy, part, m, bytes);
+                finished.up();
+            });
+            waiting += 1;
+        } else {
+            write_command(sector, count, part, m, nullptr);
+            if (copy != nullptr) copy_out(copy, part, m, bytes);
+        }
+        sector += count;
+        done += count;
+    }
+    while (waiting > 0) {
+        finished.down();
+        waiting -= 1;
+    }
+}
+
+void Ide::read_blocks(uint32_t start, const IOVec* vec, uint32_t n) {
+    static_assert(sector_size == BufferCache::BLOCK_SIZE, "the buffer cache holds sectors");
+    if (!cached) {
+        read_sectors(start, vec, n);
+        return;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) count += vec[i].bytes / block_size;
+
+    // Runs of sectors nobody has cached are read with one command,
+    // straight into their buffers, then copied out
+    constexpr uint32_t RUN = 32;
+    Cursor out{vec};
+    uint32_t done = 0;
+    while (done < count) {
+        BufferCache::Buffer* run[RUN];
+        IOVec pieces[RUN];
+        char* to[RUN];
+        BufferCache::Buffer* hit = nullptr;
+        char* hit_to = nullptr;
+        uint32_t m = 0;
 
-    //waitForDrive(drive);
+        while (done + m < count && m < RUN) {
+            bool fill;
+            // we can't wait for somebody else's read while we hold buffers
+            // they might be waiting for
+            auto b = BufferCache::get(this, start + done + m, fill, m == 0);
+            if (b == nullptr) {
+                // every buffer is pinned, read it on its own
+                if (m == 0) {
+                    IOVec one{out.next(block_size), block_size};
+                    read_sectors(start + done, &one, 1);
+                    done += 1;
+                }
+                break;
+            }
+            if (!fill) {
+                if (!b->valid.get()) {
+                    BufferCache::release(b);
+                } else {
+                    hit = b;
+                    hit_to = out.next(block_size);
+                }
+                break;
+            }
+            run[m] = b;
+            pieces[m].buffer = b->data;
+            pieces[m].bytes = block_size;
+            to[m] = out.next(block_size);
+            m += 1;
+        }
 
+        if (m > 0) {
+            read_sectors(start + done, pieces, m);
+            for (uint32_t k = 0; k < m; k++) {
+                BufferCache::ready(run[k]);
+                memcpy(to[k], run[k]->data, block_size);
+                BufferCache::release(run[k]);
+            }
+            done += m;
+        }
+        if (hit != nullptr) {
+            memcpy(hit_to, hit->data, block_size);
+            BufferCache::release(hit);
+            done += 1;
+        }
+    }
 }
-*/
 
-/*
+void Ide::read_blocks_async(uint32_t start, const IOVec* vec, uint32_t n, Completion* done) {
+    if (!use_queue(drive, vec, n)) {
+        BlockIO::read_blocks_async(start, vec, n, done);
+        return;
+    }
 
-int32_t Ide::write(uint32_t offset, const void* buffer, uint32_t n) {
-    uint32_t sector = offset / SectorSize;
-    uint32_t start = offset % SectorSize;
+    // the same commands read_sectors would make, nobody waits for them
+    auto join = new Join(done);
+    uint32_t i = 0;
+    uint32_t off = 0;
+    while (i < n) {
+        IOVec part[MAX_PIECES];
+        uint32_t m = 0;
+        uint32_t count = 0;
+        while (i < n && m < MAX_PIECES && count < MAX_SECTORS) {
+            auto bytes = K::min(vec[i].bytes - off, (MAX_SECTORS - count) * block_size);
+            part[m].buffer = vec[i].buffer + off;
+            part[m].bytes = bytes;
+            m += 1;
+            count += bytes / block_size;
+            off += bytes;
+            if (off == vec[i].bytes) {
+                i += 1;
+                off = 0;
+            }
+        }
+        auto c = join->add();
+        submit(start, part, m, false, [c] {
+            c->complete();
+        });
+        start += count;
+    }
+    join->complete();
+}
 
-    uint32_t end = start + n;
-    if (end > SectorSize) end = SectorSize;
+bool Ide::write_block(uint32_t sector, const char* buffer) {
+    uint32_t data[sector_size / sizeof(uint32_t)];
+    memcpy(data, buffer, block_size);
 
-    uint32_t count = end - start;
-    
-    if (count == SectorSize) {
-        // whole sector
-        writeSector(sector,buffer);
-    } else if (count != 0) {
-        char data[SectorSize];
-        readSector(sector,data);
-        memcpy(&data[start],buffer,count);
-        writeSector(sector,data);
+    if (cached) {
+        // no need to read it, the whole block is replaced
+        bool fill;
+        auto b = BufferCache::get(this, sector, fill);
+        if (b != nullptr) {
+            write_sector(sector, data, b->data);
+            if (fill) BufferCache::ready(b);
+            BufferCache::release(b);
+            return true;
+        }
     }
-    return count;
+
+    write_sector(sector, data, nullptr);
+    return true;
+}
+
+bool Ide::write_blocks(uint32_t start, const IOVec* vec, uint32_t n) {
+    // not kernel memory, write_block copies it a sector at a time
+    if (!direct(vec, n)) return BlockIO::write_blocks(start, vec, n);
+    if (!cached) {
+        write_sectors(start, vec, n, nullptr);
+        return true;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) count += vec[i].bytes / block_size;
+
+    // Runs of sectors we could get buffers for go out as one command,
+    // the buffers are updated when it is done
+    constexpr uint32_t RUN = 32;
+    Cursor in{vec};
+    uint32_t done = 0;
+    while (done < count) {
+        BufferCache::Buffer* run[RUN];
+        bool fill[RUN];
+        char* copies[RUN];
+        IOVec pieces[RUN];
+        uint32_t m = 0;
+        uint32_t np = 0;
+
+        while (done + m < count && m < RUN) {
+            // as in read_blocks, only wait while we hold no buffers
+            auto b = BufferCache::get(this, start + done + m, fill[m], m == 0);
+            if (b == nullptr) break;
+            if (!fill[m] && !b->valid.get()) {
+                BufferCache::release(b);
+                break;
+            }
+            run[m] = b;
+            copies[m] = b->data;
+            auto from = in.next(block_size);
+            if (np > 0 && pieces[np - 1].buffer + pieces[np - 1].bytes == from) {
+                pieces[np - 1].bytes += block_size;
+            } else {
+                pieces[np].buffer = from;
+                pieces[np].bytes = block_size;
+                np += 1;
+            }
+            m += 1;
+        }
+
+        if (m == 0) {
+            // every buffer is pinned, write it on its own
+            IOVec one{in.next(block_size), block_size};
+            write_sectors(start + done, &one, 1, nullptr);
+            done += 1;
+            continue;
+        }
+
+        write_sectors(start + done, pieces, np, copies);
+        for (uint32_t k = 0; k < m; k++) {
+            if (fill[k]) BufferCache::ready(run[k]);
+            BufferCache::release(run[k]);
+        }
+        done += m;
+    }
+    return true;
+}
+
+void Ide::sync() {
+    auto& c = controllers[controller(drive)];
+    LockGuard g{c.lock};
+    int base = port(drive);
+    int ch = channel(drive);
+    quiesce(c, base);
+
+    waitForDrive(drive);
+
+    outb(base + 6, 0xE0 | (ch << 4));
+    outb(base + 7, 0xE7);		// flush the drive's write cache
+
+    waitForDrive(drive);
 }
-*/
 
 
+uint32_t Ide::identify() {
+    auto& c = controllers[controller(drive)];
+    LockGuard g{c.lock};
+    int base = port(drive);
+    int ch = channel(drive);
+    quiesce(c, base);
+
+    outb(base + 6, 0xA0 | (ch << 4));	// select the drive
+    auto status = getStatus(drive);
+    if ((status == 0) || (status == 0xFF)) {
+        // nothing on the bus
+        return 0;
+    }
+
+    outb(base + 2, 0);
+    outb(base + 3, 0);
+    outb(base + 4, 0);
+    outb(base + 5, 0);
+    outb(base + 7, 0xEC);		// identify
+
+    if (getStatus(drive) == 0) {
+        return 0;
+    }
+    while ((getStatus(drive) & BSY) != 0) {
+        pause();
+    }
+    if ((inb(base + 4) != 0) || (inb(base + 5) != 0)) {
+        // not an ATA disk (ATAPI, SATA, ...)
+        return 0;
+    }
+    while (((status = getStatus(drive)) & (DRQ | ERR)) == 0) {
+        pause();
+    }
+    if ((status & ERR) != 0) {
+        return 0;
+    }
+
+    uint32_t info[sector_size / sizeof(uint32_t)];
+    for (uint32_t i=0; i<sector_size/sizeof(uint32_t); i++) {
+        info[i] = inl(base);
+    }
+
+    // words 60 and 61: number of sectors addressable with LBA28
+    return info[30];
+}
+
 void ideStats(void) {
     Debug::printf("nRead %d\n",nRead);
     Debug::printf("nWrite %d\n",nWrite);
+    Debug::printf("nDma %d\n",nDma);
+    Debug::printf("nCommands %d\n",nCommands);
+    Debug::printf("nQueued %d\n",nQueued);
+    Debug::printf("nMerged %d\n",nMerged);
 }
@@ -21,19 +21,127 @@ class Ide : public BlockIO {  // We are a block device
     
     uint32_t drive; /* 0 -> A, 1 -> B, 2 -> C, 3 -> D */
 
-    InterruptSafeLock lock;
-
     Atomic<uint32_t> ref_count;
 
+    // go through the buffer cache? (not for swap)
+    const bool cached;
+
+    // Transfers, through the request queue if we can block and polled
+    // PIO if not. write_sector also updates the cached copy (if any)
+    // before the next transfer can start so the cache and the disk
+    // agree on the order of concurrent writes
+    void read_sectors(uint32_t sector, const IOVec* vec, uint32_t n);
+    void write_sector(uint32_t sector, const uint32_t* data, char* cached_copy);
+
+    // Multi-sector writes, copies (if not null) has a cached copy to
+    // update for every sector
+    void write_sectors(uint32_t sector, const IOVec* vec, uint32_t n, char* const* copies);
+
+    // One multi-sector command, DMA if we can block
+    void read_command(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n);
+    void write_command(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n, char* cached_copy);
+
+    // Polled, from and to kernel memory
+    void pio_read(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n);
+    void pio_write(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n);
+
+    // Returns false if it didn't do the transfer
+    bool dma(uint32_t sector, uint32_t count, const IOVec* vec, uint32_t n, bool write, char* cached_copy);
+
+public:
+    // the most a request (or a merged batch of them) can have
+    constexpr static uint32_t MAX_SECTORS = 128;
+    constexpr static uint32_t MAX_PIECES = 16;
+
+    // An asynchronous transfer, see the request queue in ide.cc
+    struct Request {
+        uint32_t sector;
+        uint32_t count;
+        IOVec vec[MAX_PIECES];
+        uint32_t n;
+        bool write;
+        const void* owner;      // the process that asked, for fairness
+        uint32_t deadline;      // in jiffies
+        Request* next;
+
+        virtual ~Request() {}
+
+        // Runs on the drive's queue thread once the data has moved
+        virtual void complete() = 0;
+    };
+
+    // Can a transfer of these pieces go through the request queue? Not
+    // before start_queues, with interrupts disabled, on an idle thread,
+    // or for memory the queue thread can't see
+    bool queued(const IOVec* vec, uint32_t n);
+
+    // Queue a transfer and return right away, only if queued() says so.
+    // The pieces have to be at most MAX_PIECES and MAX_SECTORS in all,
+    // and they stay untouched until done() is called on the queue
+    // thread. done() holds up the drive, it shouldn't block or do I/O of
+    // its own. The transfer goes around the buffer cache
+    template <typename Done>
+    void submit(uint32_t sector, const IOVec* vec, uint32_t n, bool write, Done done) {
+        struct Impl : public Request {
+            Done done;
+            Impl(Done done) : done(done) {}
+            void complete() override {
+                done();
+            }
+        };
+        enqueue(new Impl(done), sector, vec, n, write);
+    }
+
+private:
+    void enqueue(Request* r, uint32_t sector, const IOVec* vec, uint32_t n, bool write);
+
+    // The queue thread of a drive, never returns
+    static void serve(uint32_t drive);
+
 public:
-    Ide(uint32_t drive) : BlockIO(sector_size), drive(drive), ref_count(0) {}
+    Ide(uint32_t drive, bool cached = false) : BlockIO(sector_size), drive(drive), ref_count(0), cached(cached) {}
 
     virtual ~Ide() {}
     
     // Read the given block into the given buffer. We assume the
-    // buffer is big enough
+    // buffer is big enough. Served from the buffer cache if we can
     void read_block(uint32_t block_number, char* buffer) override;
 
+    // Sectors that aren't cached go out as multi-sector commands
+    using BlockIO::read_blocks;
+    void read_blocks(uint32_t start, const IOVec* vec, uint32_t n) override;
+
+    // Queued commands nobody waits for. They go around the buffer cache,
+    // the caller keeps the data (the page cache). Reads right away if
+    // the pieces can't be queued
+    void read_blocks_async(uint32_t start, const IOVec* vec, uint32_t n, Completion* done) override;
+
+    // Write the given block from the given buffer. The data might
+    // sit in the drive's cache until sync() is called. The buffer
+    // cache is written through
+    bool write_block(uint32_t block_number, const char* buffer) override;
+
+    // Runs of sectors go out as multi-sector commands, the buffer cache
+    // is written through
+    using BlockIO::write_blocks;
+    bool write_blocks(uint32_t start, const IOVec* vec, uint32_t n) override;
+
+    // Wait until all the writes we issued are on the media. Requests
+    // still in the queue aren't waited for
+    void sync() override;
+
+    // Find the bus master on the PCI bus and route the disk interrupts
+    // to this core. Called once, after IDT::init
+    static void init_dma();
+
+    // Start a queue thread for each drive that is there. Until then
+    // (and for the others) every transfer is synchronous
+    static void start_queues();
+
+    // Ask the drive to describe itself. Returns the number of sectors
+    // or 0 if there is no (ATA) disk attached at this position
+    uint32_t identify();
+
     // We lie because I'm too lazy to get the actual drive size
     // This means that we'll get QEMU errors if we try to access
     // non existent blocks.
@@ -45,4 +153,6 @@ public:
     friend class Shared<Ide>;
 };
 
+extern "C" void ideHandler_();
+
 #endif
@@ -17,6 +17,9 @@
 #include "tss.h"
 #include "sys.h"
 #include "process.h"
+#include "swap.h"
+#include "buffer_cache.h"
+#include "ide.h"
 
 struct Stack {
     static constexpr int BYTES = 4096;
@@ -36,7 +39,7 @@ static Atomic<uint32_t> howManyAreHere(0);
 bool onHypervisor = true;
 
 static constexpr uint32_t HEAP_START = 1 * 1024 * 1024;
-static constexpr uint32_t HEAP_SIZE = 5 * 1024 * 1024;
+static constexpr uint32_t HEAP_SIZE = 2 * 1024 * 1024;    // to boot with, it grows from PhysMem
 static constexpr uint32_t VMM_FRAMES = HEAP_START + HEAP_SIZE;
 
 extern "C" void kernelInit(void) {
@@ -107,6 +110,9 @@ extern "C" void kernelInit(void) {
         /* initialize VMM */
         VMM::global_init();
 
+        /* before the global constructors mount the root file system */
+        BufferCache::init();
+
         /* global constructors */
         CRT::init();
 
@@ -116,14 +122,30 @@ extern "C" void kernelInit(void) {
         /* initialize the thread module */
         threadsInit();
 
+        /* start writing dirty shared pages back in the background */
+        VMM::start_flusher();
+
+        /* find the swap disk */
+        Swap::init();
+
         /* initialize LAPIC */
         SMP::init(true);
         smpInitDone = true;
+
+        /* per-CPU frame and heap caches need SMP::me() */
+        PhysMem::enable_magazines();
+        heapEnableCaches();
   
         /* initialize IDT */
         IDT::init();
         Pit::calibrate(1000);
 
+        /* disk interrupts and DMA */
+        Ide::init_dma();
+
+        /* disk requests are queued from here on */
+        Ide::start_queues();
+
         SMP::running.fetch_add(1);
 
         // The reset EIP has to be
@@ -162,7 +184,7 @@ extern "C" void kernelInit(void) {
         auto initProc = Shared<Process>::make(true);
         thread(initProc,[] {
             kernelMain();
-            Debug::shutdown();
+            kernelShutdown();
         });
     }
     stop();
@@ -4,12 +4,17 @@
 #include "ext2.h"
 #include "sys.h"
 #include "threads.h"
+#include "swap.h"
+#include "buffer_cache.h"
+#include "physmem.h"
+#include "vmm.h"
+#include "heap.h"
 
 const char* initName = "/sbin/init";
 
 
 namespace gheith {
-    Shared<Ext2> root_fs = Shared<Ext2>::make(Shared<Ide>::make(1));
+    Shared<Ext2> root_fs = Shared<Ext2>::make(Shared<Ide>::make(1, true));
 }
 
 void kernelMain(void) {
@@ -21,3 +26,12 @@ void kernelMain(void) {
     Debug::panic("*** rc = %d",rc);
 }
 
+
+void kernelShutdown(void) {
+    Swap::stats();
+    BufferCache::stats();
+    PhysMem::report();
+    VMM::fault_report();
+    heapReport();
+    Debug::shutdown();
+}
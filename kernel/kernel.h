@@ -6,6 +6,9 @@
 
 void kernelMain(void);
 
+// print the subsystem reports and power off
+void kernelShutdown(void);
+
 namespace gheith {
     extern Shared<Ext2> root_fs;
 }
@@ -23,6 +23,17 @@ public:
         return (a < rest) ? a : rest;
     }
 
+    template <typename T>
+    static T max(T v) {
+        return v;
+    }
+
+    template <typename T, typename... More>
+    static T max(T a, More... more) {
+        auto rest = max(more...); 
+        return (a > rest) ? a : rest;
+    }
+
 
 };
 
@@ -12,6 +12,7 @@ extern "C" void outl(int port, int val);
 
 extern "C" uint64_t rdmsr(uint32_t id);
 extern "C" void wrmsr(uint32_t id, uint64_t value);
+extern "C" uint64_t rdtsc(void);
 
 extern "C" void vmm_on(uint32_t pd);
 extern "C" void invlpg(uint32_t va);
@@ -19,6 +20,7 @@ extern "C" void invlpg(uint32_t va);
 extern "C" void apitHandler_(void);
 extern "C" void spuriousHandler_(void);
 extern "C" void pageFaultHandler_(void);
+extern "C" void tlbHandler_(void);
 
 extern "C" void* memcpy(void *dest, const void* src, size_t n);
 extern "C" void* bzero(void *dest, size_t n);
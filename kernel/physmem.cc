@@ -4,6 +4,10 @@
 #include "debug.h"
 #include "atomic.h"
 #include "idt.h"
+#include "vmm.h"
+#include "smp.h"
+#include "config.h"
+#include "libk.h"
 
 namespace PhysMem {
 
@@ -13,50 +17,385 @@ namespace PhysMem {
         Frame* next;
     };
 
-    static Frame* firstFree = nullptr;
-    static uint32_t avail;
+    // Buddy allocator. A free block of order k is 2^k frames, aligned to
+    // its size. Its buddy is the block we get by flipping bit (12 + k) of
+    // its address; when both are free they merge into a block of order
+    // k+1. Free blocks live on a per-order doubly linked list threaded
+    // through the blocks themselves.
+    struct Block {
+        Block* next;
+        Block* prev;
+    };
+
+    static Block* freeList[MAX_ORDER + 1];
+    static uint32_t nFree[MAX_ORDER + 1];
+
+    // one byte per frame: FREE | order for the first frame of a free
+    // block, 0 for everything else
+    constexpr uint8_t FREE = 0x80;
+    static uint8_t* state = nullptr;
+
+    static uint32_t first;
     static uint32_t limit;
 
-    uint32_t alloc_frame() {
-        LockGuard g{lock};
+    static Frame* firstZero = nullptr;    // already zero-filled
+    static uint32_t nZero = 0;
 
-        uint32_t p;
+    // how many frames we ask the VMM to give back when we run out
+    constexpr uint32_t RECLAIM_BATCH = 16;
+
+    // how many zero-filled frames the idle cores keep around
+    constexpr uint32_t ZERO_POOL = 64;
 
-        if (firstFree != nullptr) {
-            p = (uint32_t) firstFree;
-            firstFree = firstFree->next;
+    static inline uint32_t index(uint32_t pa) {
+        return (pa - first) / FRAME_SIZE;
+    }
+
+    // The caller holds the lock for all the buddy_* functions
+    static void buddy_push(uint32_t pa, uint32_t order) {
+        auto b = (Block*) pa;
+        b->prev = nullptr;
+        b->next = freeList[order];
+        if (b->next != nullptr) b->next->prev = b;
+        freeList[order] = b;
+        nFree[order] += 1;
+        state[index(pa)] = FREE | order;
+    }
+
+    static void buddy_remove(uint32_t pa, uint32_t order) {
+        auto b = (Block*) pa;
+        if (b->prev == nullptr) {
+            freeList[order] = b->next;
         } else {
-            if (avail == limit) {
-                Debug::panic("no more frames");
+            b->prev->next = b->next;
+        }
+        if (b->next != nullptr) b->next->prev = b->prev;
+        nFree[order] -= 1;
+        state[index(pa)] = 0;
+    }
+
+    // Returns the first frame of a block of the given order, 0 if there
+    // is none. Bigger blocks are split on the way down.
+    static uint32_t buddy_alloc(uint32_t order) {
+        uint32_t k = order;
+        while (k <= MAX_ORDER && freeList[k] == nullptr) k++;
+        if (k > MAX_ORDER) return 0;
+
+        auto pa = (uint32_t) freeList[k];
+        buddy_remove(pa, k);
+        while (k > order) {
+            k -= 1;
+            buddy_push(pa + (FRAME_SIZE << k), k);
+        }
+        return pa;
+    }
+
+    static void buddy_free(uint32_t pa, uint32_t order) {
+        ASSERT((pa >= first) && (pa < limit));
+        ASSERT((pa & ((FRAME_SIZE << order) - 1)) == 0);
+        ASSERT(state[index(pa)] == 0);
+
+        while (order < MAX_ORDER) {
+            auto buddy = pa ^ (FRAME_SIZE << order);
+            if ((buddy < first) || (buddy >= limit)) break;
+            if (state[index(buddy)] != (FREE | order)) break;
+            buddy_remove(buddy, order);
+            pa = K::min(pa, buddy);
+            order += 1;
+        }
+        buddy_push(pa, order);
+    }
+
+    // A frame that nobody zeroed yet, 0 if there are none. The caller
+    // holds the lock.
+    static uint32_t take_dirty() {
+        return buddy_alloc(0);
+    }
+
+    static uint32_t take_zero() {
+        auto f = firstZero;
+        firstZero = f->next;
+        nZero -= 1;
+        f->next = nullptr;
+        return (uint32_t) f;
+    }
+
+    // Per-CPU magazines: a small stack of (unzeroed) free frames in front
+    // of the global list. Each core refills and drains its own in batches
+    // so most allocations never touch the global lock. The magazine lock
+    // is only contended when a core runs dry and steals from the others.
+    constexpr uint32_t MAGAZINE_SIZE = 32;
+    constexpr uint32_t MAGAZINE_BATCH = MAGAZINE_SIZE / 2;
+
+    struct Magazine {
+        InterruptSafeLock lock{};
+        uint32_t count = 0;
+        uint32_t frames[MAGAZINE_SIZE];
+    };
+
+    static PerCPU<Magazine> magazines;
+
+    // SMP::me() only works once the local APIC is set up
+    static bool use_magazines = false;
+
+    // Put a frame back in the buddy allocator. The caller holds the lock.
+    static void put_dirty(uint32_t p) {
+        ASSERT(offset(p) == 0);
+        buddy_free(p, 0);
+    }
+
+    // Take up to n frames from this core's magazine (refilling it from the
+    // global list if it is empty). Returns how many we got.
+    static uint32_t magazine_alloc(uint32_t* frames, uint32_t n) {
+        uint32_t got = 0;
+        auto was = Interrupts::disable();
+        auto& mag = magazines.mine();
+        {
+            LockGuard g{mag.lock};
+            if (mag.count == 0) {
+                LockGuard g2{lock};
+                while (mag.count < MAGAZINE_BATCH) {
+                    auto p = take_dirty();
+                    if (p == 0) break;
+                    mag.frames[mag.count++] = p;
+                }
+            }
+            while (got < n && mag.count != 0) {
+                frames[got++] = mag.frames[--mag.count];
             }
-            p = avail;
-            avail += FRAME_SIZE;
         }
+        Interrupts::restore(was);
+        return got;
+    }
+
+    // Give frames back to this core's magazine, the overflow goes to the
+    // global list in one go.
+    static void magazine_free(const uint32_t* frames, uint32_t n) {
+        auto was = Interrupts::disable();
+        auto& mag = magazines.mine();
+        {
+            LockGuard g{mag.lock};
+            uint32_t i = 0;
+            while (i < n && mag.count < MAGAZINE_SIZE) {
+                mag.frames[mag.count++] = frames[i++];
+            }
+            if (i < n || mag.count == MAGAZINE_SIZE) {
+                LockGuard g2{lock};
+                while (i < n) {
+                    put_dirty(frames[i++]);
+                }
+                // leave room for the next few frees
+                while (mag.count > MAGAZINE_BATCH) {
+                    put_dirty(mag.frames[--mag.count]);
+                }
+            }
+        }
+        Interrupts::restore(was);
+    }
+
+    // The global list is empty, look in the other cores' magazines
+    static uint32_t steal() {
+        for (uint32_t i = 0; i < kConfig.totalProcs; i++) {
+            auto& mag = magazines.forCPU(i);
+            LockGuard g{mag.lock};
+            if (mag.count != 0) {
+                return mag.frames[--mag.count];
+            }
+        }
+        return 0;
+    }
+
+    static uint32_t take_frame(bool zeroed) {
+        uint32_t p = 0;
+        bool clean = false;
+
+        // zeroed frames come from the (global) pool if it has any
+        if (use_magazines && !(zeroed && nZero != 0)) {
+            magazine_alloc(&p, 1);
+        }
+
+        if (p == 0) {
+            LockGuard g{lock};
+
+            clean = zeroed && (firstZero != nullptr);
+            if (clean) {
+                p = take_zero();
+            } else {
+                p = take_dirty();
+                if (p == 0 && firstZero != nullptr) {
+                    // only zeroed frames left, they work for anybody
+                    p = take_zero();
+                    clean = true;
+                }
+            }
+        }
+
+        if (p == 0 && use_magazines) {
+            p = steal();
+        }
+
+        if (p == 0) return 0;
 
         ASSERT(offset(p) == 0);
 
-        bzero((void*)p,FRAME_SIZE);
+        // zero outside the lock, with interrupts on
+        if (zeroed && !clean) {
+            bzero((void*)p,FRAME_SIZE);
+        }
 
         return p;
     }
 
-    void dealloc_frame(uint32_t p) {
+    uint32_t alloc_frame(bool zeroed, bool reclaim) {
+        while (true) {
+            auto p = take_frame(zeroed);
+            if (p != 0) return p;
+
+            // Out of frames. Reclaiming might need to block (disk I/O) so
+            // we can only do it from a thread that can block
+            if (!reclaim || Interrupts::isDisabled() || VMM::reclaim(RECLAIM_BATCH) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    bool alloc_frames(uint32_t* frames, uint32_t n, bool zeroed, bool reclaim) {
+        uint32_t got = 0;
+
+        if (use_magazines) {
+            got = magazine_alloc(frames, n);
+        }
+
+        if (got < n) {
+            LockGuard g{lock};
+            while (got < n) {
+                auto p = take_dirty();
+                if (p == 0) break;
+                frames[got++] = p;
+            }
+        }
+
+        if (zeroed) {
+            for (uint32_t i = 0; i < got; i++) {
+                bzero((void*)frames[i],FRAME_SIZE);
+            }
+        }
+
+        // the slow way for the rest: zero pool, stealing, reclaim
+        while (got < n) {
+            auto p = alloc_frame(zeroed, reclaim);
+            if (p == 0) {
+                dealloc_frames(frames, got);
+                return false;
+            }
+            frames[got++] = p;
+        }
+        return true;
+    }
+
+    bool zero_one() {
+        uint32_t p;
+        {
+            LockGuard g{lock};
+            if (nZero >= ZERO_POOL) return false;
+            p = take_dirty();
+            if (p == 0) return false;
+        }
+
+        bzero((void*)p,FRAME_SIZE);
+
         LockGuard g{lock};
+        Frame* f = (Frame*) p;
+        f->next = firstZero;
+        firstZero = f;
+        nZero += 1;
+        return true;
+    }
 
-        ASSERT(offset(p) == 0);
+    void dealloc_frames(const uint32_t* frames, uint32_t n) {
+        if (n == 0) return;
 
-        Frame* f = (Frame*) p;    
-        f->next = firstFree;
-        firstFree = f;
+        if (use_magazines) {
+            magazine_free(frames, n);
+            return;
+        }
+
+        LockGuard g{lock};
+        for (uint32_t i = 0; i < n; i++) {
+            put_dirty(frames[i]);
+        }
+    }
+
+    void dealloc_frame(uint32_t p) {
+        dealloc_frames(&p, 1);
     }
 
+    void enable_magazines() {
+        use_magazines = true;
+    }
+
+    uint32_t alloc_contiguous(uint32_t order, bool reclaim) {
+        ASSERT(order <= MAX_ORDER);
+        while (true) {
+            {
+                LockGuard g{lock};
+                auto p = buddy_alloc(order);
+                if (p != 0) return p;
+            }
+            // Reclaimed frames might merge into what we need. No promises.
+            if (!reclaim || Interrupts::isDisabled() || VMM::reclaim(K::max(RECLAIM_BATCH, uint32_t(1) << order)) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    void dealloc_contiguous(uint32_t pa, uint32_t order) {
+        ASSERT(order <= MAX_ORDER);
+        LockGuard g{lock};
+        buddy_free(pa, order);
+    }
+
+    void report() {
+        uint32_t cached = 0;
+        for (uint32_t i = 0; i < kConfig.totalProcs; i++) {
+            cached += magazines.forCPU(i).count;
+        }
+
+        LockGuard g{lock};
+        uint32_t total = 0;
+        int largest = -1;
+        for (uint32_t k = 0; k <= MAX_ORDER; k++) {
+            total += nFree[k] << k;
+            if (nFree[k] != 0) largest = k;
+        }
+        Debug::printf("| physmem: %d free frames in the buddy lists, %d zeroed, %d in magazines\n",total,nZero,cached);
+        for (uint32_t k = 0; k <= MAX_ORDER; k++) {
+            Debug::printf("|    order %d: %d blocks\n",k,nFree[k]);
+        }
+        // how much of the free memory can't be handed out as one block of
+        // the largest order we have, in percent
+        uint32_t frag = (total == 0) ? 0 : 100 - (100 * (nFree[largest] << largest)) / total;
+        Debug::printf("|    largest free order %d, fragmentation %d%%\n",largest,frag);
+    }
 
     void init(uint32_t start, uint32_t size) {
         ASSERT(offset(start) == 0);
         ASSERT(offset(size) == 0);
         Debug::printf("| physical range 0x%x 0x%x\n",start,start+size);
-        avail = start;
+        first = start;
         limit = start + size;
+        state = new uint8_t[size / FRAME_SIZE]();
+
+        // carve the range into the biggest aligned blocks that fit
+        LockGuard g{lock};
+        for (uint32_t p = start; p < limit; ) {
+            uint32_t k = MAX_ORDER;
+            while (k > 0 && (((p & ((FRAME_SIZE << k) - 1)) != 0) || (p + (FRAME_SIZE << k) > limit))) {
+                k -= 1;
+            }
+            buddy_push(p, k);
+            p += FRAME_SIZE << k;
+        }
 
         /* register the page fault handler */
         IDT::trap(14,(uint32_t)pageFaultHandler_,3);
@@ -6,6 +6,9 @@
 namespace PhysMem {
     constexpr uint32_t FRAME_SIZE = 1 << 12;
 
+    // The buddy allocator hands out blocks of 2^0 to 2^10 frames (4MB)
+    constexpr uint32_t MAX_ORDER = 10;
+
     void init(uint32_t start, uint32_t size);
 
     inline uint32_t offset(uint32_t pa) {
@@ -24,9 +27,41 @@ namespace PhysMem {
         return framedown(pa + FRAME_SIZE - 1);
     }
 
-    uint32_t alloc_frame();
+    // Returns a frame, zero-filled unless the caller is going to
+    // overwrite all of it anyway. Returns 0 when we run out.
+    //
+    // With reclaim = true we try to get frames back first (see
+    // VMM::reclaim). That can write to the disk and takes the page cache
+    // and swap locks, so only callers that hold no locks (page faults,
+    // fork) ask for it. Everybody else gets 0 right away
+    uint32_t alloc_frame(bool zeroed = true, bool reclaim = false);
+
+    // Zero one free frame for the pre-zeroed pool. Called by idle cores,
+    // returns false if there was nothing to do
+    bool zero_one();
+
+    // Get n frames at once (fork). All or nothing: returns false and
+    // gives back what it got if it can't find all of them
+    bool alloc_frames(uint32_t* frames, uint32_t n, bool zeroed = true, bool reclaim = false);
 
     void dealloc_frame(uint32_t);
+
+    // Give back n frames at once (address space teardown)
+    void dealloc_frames(const uint32_t* frames, uint32_t n);
+
+    // Start using the per-CPU frame caches, once SMP::me() works
+    void enable_magazines();
+
+    // Physically contiguous 2^order frames, aligned to their size (not
+    // zero-filled). Returns 0 if there is no such block. reclaim is the
+    // same as for alloc_frame, the kernel heap never asks for it
+    uint32_t alloc_contiguous(uint32_t order, bool reclaim = false);
+
+    // Give back a block from alloc_contiguous, same order
+    void dealloc_contiguous(uint32_t pa, uint32_t order);
+
+    // Print free blocks per order and how fragmented free memory is
+    void report();
 }
 
 #endif
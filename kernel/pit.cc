@@ -5,6 +5,7 @@
 #include "smp.h"
 #include "threads.h"
 #include "process.h"
+#include "semaphore.h"
 
 /*
  * The old PIT runs at a fixed frequency of 1193182Hz but doesn't support
@@ -38,6 +39,40 @@ struct PitInfo {
 
 static PitInfo *pitInfo = nullptr;
 
+// Sleeping threads, soonest first. The APIT handler on core 0 wakes
+// them up
+struct Sleeper {
+    uint32_t wake;
+    Semaphore* go;
+    Sleeper* next;
+};
+
+static Sleeper* sleepers = nullptr;
+static InterruptSafeLock sleepLock{};
+
+void Pit::sleep(uint32_t n) {
+    Semaphore go{0};
+    Sleeper me{jiffies + n, &go, nullptr};
+    {
+        LockGuard g{sleepLock};
+        auto pp = &sleepers;
+        while (*pp != nullptr && int32_t((*pp)->wake - me.wake) <= 0) pp = &(*pp)->next;
+        me.next = *pp;
+        *pp = &me;
+    }
+    go.down();
+}
+
+// Interrupts are disabled
+static void wakeSleepers() {
+    LockGuard g{sleepLock};
+    while (sleepers != nullptr && int32_t(Pit::jiffies - sleepers->wake) >= 0) {
+        auto s = sleepers;
+        sleepers = s->next;
+        s->go->up();
+    }
+}
+
 /* Do what you need to do in order to run the APIT at the given
  * frequency. Should be called by the bootstrap CPI
  */
@@ -141,6 +176,7 @@ extern "C" void apitHandler(uint32_t* things) {
     auto id = SMP::me();
     if (id == 0) {
         Pit::jiffies ++;
+        wakeSleepers();
     }
     SMP::eoi_reg.set(0);
     auto me = gheith::activeThreads[id];
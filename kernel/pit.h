@@ -18,6 +18,8 @@ public:
     static uint32_t secondsToJiffies(uint32_t secs) {
         return jiffiesPerSecond * secs;
     }
+    // Block the calling thread for at least the given number of jiffies
+    static void sleep(uint32_t jiffies);
     static uint32_t seconds(void) {
         return jiffies / jiffiesPerSecond;
         return 0;
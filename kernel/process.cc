@@ -2,6 +2,7 @@
 #include "physmem.h"
 #include "debug.h"
 #include "vmm.h"
+#include "swap.h"
 
 // id encoding
 //   upper bit -> sign
@@ -29,8 +30,19 @@ Process::Process(bool isInit) {
 }
 
 Process::~Process() {
-	gheith::delete_pd(pd);
+	if (pd != nullptr) {
+		gheith::delete_pd(pd, entry_list);
+	}
+	delete_entries();
+}
 
+void Process::delete_entries() {
+	while (entry_list != nullptr) {
+		auto e = entry_list;
+		entry_list = e->next;
+		delete e;
+	}
+	mappings = 0;
 }
 
 int Process::newSemaphore(uint32_t init) {
@@ -61,7 +73,8 @@ void Process::clear_private() {
 
 	LockGuard<BlockingLock> g { mutex };
 
-	delete_private(pd);
+	delete_private(pd, entry_list);
+	delete_entries();
 }
 
 Shared<Process> Process::fork(int& id) {
@@ -83,6 +96,42 @@ Shared<Process> Process::fork(int& id) {
 	}
 
 	auto child = Shared<Process>::make(false);
+	if (child->pd == nullptr) {
+		id = -1;
+		return Shared<Process>{};
+	}
+
+	// deep copy entry list (first, it tells ~Process what to free if we fail)
+	if (entry_list == nullptr) {
+		child->entry_list = nullptr;
+	} else {
+		child->entry_list = new VMEntry(entry_list->file, entry_list->size, entry_list->starting_address, entry_list->offset, nullptr, entry_list->flags, entry_list->prot);
+		child->entry_list->advice = entry_list->advice;
+		child->entry_list->file_end = entry_list->file_end;
+		child->entry_list->shm = entry_list->shm;
+		VMEntry* temp = entry_list->next;
+		VMEntry* temp2 = child->entry_list;
+		while (temp != nullptr) {
+			temp2->next = new VMEntry(temp->file, temp->size, temp->starting_address, temp->offset, nullptr, temp->flags, temp->prot);
+			temp2->next->advice = temp->advice;
+			temp2->next->file_end = temp->file_end;
+			temp2->next->shm = temp->shm;
+			temp = temp->next;
+			temp2 = temp2->next;
+		}
+	}
+	child->mappings = mappings;
+	for (auto e = child->entry_list; e != nullptr; e = e->next) {
+		if (e->file != nullptr && (e->flags & 0x1)) {
+			gheith::track_dirty(child->pd);
+			break;
+		}
+	}
+
+	// frames for the copies, we get them from PhysMem in batches
+	constexpr uint32_t FORK_BATCH = 32;
+	uint32_t frames[FORK_BATCH];
+	uint32_t have = 0;
 
 	// copy the private portion of the address space
 	for (unsigned pdi=512; pdi<1024; pdi++) {
@@ -94,7 +143,12 @@ Shared<Process> Process::fork(int& id) {
 		auto child_pt = (uint32_t*) (child_pde & 0xFFFFF000);
 		
 		if ((child_pde & 1) == 0) {
-			child_pt = (uint32_t*) PhysMem::alloc_frame();
+			child_pt = (uint32_t*) PhysMem::alloc_frame(true, true);
+			if (child_pt == nullptr) {
+				PhysMem::dealloc_frames(frames, have);
+				id = -1;
+				return Shared<Process>{};
+			}
 			child->pd[pdi] = uint32_t(child_pt) | 7;
 		}
 		
@@ -102,40 +156,57 @@ Shared<Process> Process::fork(int& id) {
 			auto child_pte = child_pt[pti];
 			if ((child_pte & 1) == 1) continue;
 			auto parent_pte = parent_pt[pti];
-			if ((parent_pte & 1) == 0) continue;
-			auto parent_frame = parent_pte & 0xFFFFF000;
+			if (parent_pte == 0) continue;
+			if (parent_pte & gheith::PTE_SHARED) {
+				// page cache frames are shared with the child, not copied
+				// (read-only ones stay read-only, copy on write)
+				gheith::share_page(parent_pte & 0xFFFFF000);
+				child_pt[pti] = parent_pte & ~gheith::PTE_DIRTY;
+				continue;
+			}
+			if ((parent_pte & 1) && (parent_pte & 0xFFFFF000) == gheith::zero_page) {
+				// nothing to copy, the child reads the same zeros
+				child_pt[pti] = parent_pte;
+				continue;
+			}
+			if (parent_pte & gheith::PTE_SHM) {
+				// shared anonymous memory, the child's entry holds the object too
+				child_pt[pti] = parent_pte & ~gheith::PTE_DIRTY;
+				continue;
+			}
+			if (have == 0) {
+				// enough frames for the rest of this page table, up to a batch
+				uint32_t want = 0;
+				for (unsigned i=pti; i<1024 && want<FORK_BATCH; i++) {
+					auto e = parent_pt[i];
+					if (e == 0 || (e & (gheith::PTE_SHARED | gheith::PTE_SHM)) || (child_pt[i] & 1)) continue;
+					if ((e & 1) && (e & 0xFFFFF000) == gheith::zero_page) continue;
+					want++;
+				}
+				if (!PhysMem::alloc_frames(frames, want, false, true)) {   // we copy all of them
+					id = -1;
+					return Shared<Process>{};
+				}
+				have = want;
+			}
 			//Debug::printf("fork: copying %x\n",(pdi << 22) | (pti << 12));
-			auto child_frame = PhysMem::alloc_frame();
-			//Debug::printf("fork: copying:%x, parent:%x, child:%x\n",(pdi << 22) | (pti << 12),parent_frame,child_frame);
-			memcpy((void*)child_frame,(void*)parent_frame,PhysMem::FRAME_SIZE);
+			auto child_frame = frames[--have];
+			// getting the frames might have pushed the parent's page out to swap
+			parent_pte = parent_pt[pti];
+			if (parent_pte & 1) {
+				auto parent_frame = parent_pte & 0xFFFFF000;
+				//Debug::printf("fork: copying:%x, parent:%x, child:%x\n",(pdi << 22) | (pti << 12),parent_frame,child_frame);
+				memcpy((void*)child_frame,(void*)parent_frame,PhysMem::FRAME_SIZE);
+			} else {
+				Swap::read(parent_pte >> 12, child_frame);
+			}
 			child_pt[pti] = uint32_t(child_frame) | 7;
+			fork_copies++;
 		}
 	}
 
-	// deep copy entry list
-	if (entry_list == nullptr) {
-		child->entry_list = nullptr;
-	} else {
-		child->entry_list = new VMEntry(entry_list->file, entry_list->size, entry_list->starting_address, entry_list->offset, nullptr, entry_list->flags, entry_list->prot);
-		child->entry_list->node = entry_list->node;
-		VMEntry* temp = entry_list->next;
-		VMEntry* temp2 = child->entry_list;
-		while (temp != nullptr) {
-			temp2->next = new VMEntry(temp->file, temp->size, temp->starting_address, temp->offset, nullptr, temp->flags, temp->prot);
-			temp2->next->node = temp->node;
-			temp = temp->next;
-			temp2 = temp2->next;
-		}
-	}
-
-	// increment num processed on node list
-	VMEntry* temp = child->entry_list;
-	while (temp != nullptr) {
-		if (temp->node != nullptr) {
-			temp->node->num_processes++;
-		}
-		temp = temp->next;
-	}
+	// reclaim might have unmapped some of the pages we counted
+	PhysMem::dealloc_frames(frames, have);
 
 	//child->addressSpace->copyFrom(addressSpace);
 	for (auto i = 0; i<NSEM; i++) {
@@ -234,13 +305,3 @@ int Process::kill(int id) {
 	kill_flags[index] = nullptr;
 	return 0;
 }
-
-void Process::decrementFiles() {
-	VMEntry* temp = entry_list;
-	while (temp != nullptr) {
-		if (temp->node != nullptr) {
-			temp->node->num_processes--;
-		}
-		temp = temp->next;
-	}
-}
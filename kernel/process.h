@@ -35,6 +35,14 @@ public:
     Shared<Atomic<int>> run_time = Shared<Atomic<int>>::make(0);
     uint32_t *pd = gheith::make_pd();
     VMEntry* entry_list = nullptr;
+    uint32_t clock_hand = 0x80000000;   // where page reclaim looks next
+
+    // memory counters for getrusage, resident pages are counted from the
+    // page tables when somebody asks
+    uint32_t minor_faults = 0;   // served from memory
+    uint32_t major_faults = 0;   // had to read swap or a file
+    uint32_t fork_copies = 0;    // frames copied for our children
+    uint32_t mappings = 0;       // entries on entry_list
 
     static Shared<Process> kernelProcess;
 
@@ -43,6 +51,7 @@ public:
 
 	Shared<Process> fork(int& id);
     void clear_private();
+    void delete_entries();
 
 	int newSemaphore(uint32_t init);
 
@@ -75,8 +84,6 @@ public:
 	int wait(int id, uint32_t* ptr);
 
     int kill(int id);
-    
-    void decrementFiles();
 
 	static void init(void);
 
@@ -0,0 +1,94 @@
+#include "shm.h"
+#include "physmem.h"
+#include "libk.h"
+#include "debug.h"
+#include "blocking_lock.h"
+
+SharedMemory::SharedMemory(uint32_t pages) : pages(pages) {
+    frames = new uint32_t[pages]();
+}
+
+SharedMemory::~SharedMemory() {
+    // nobody maps us anymore, the PTEs are gone and shot down
+    for (uint32_t i = 0; i < pages; i++) {
+        if (frames[i] != 0) PhysMem::dealloc_frame(frames[i]);
+    }
+    delete[] frames;
+}
+
+uint32_t SharedMemory::frame(uint32_t i) {
+    ASSERT(i < pages);
+    {
+        LockGuard g{lock};
+        if (frames[i] != 0) return frames[i];
+    }
+
+    // not under the lock, reclaim might take a while (we're called
+    // from page faults)
+    auto pa = PhysMem::alloc_frame(true, true);
+    if (pa == 0) return 0;
+
+    LockGuard g{lock};
+    if (frames[i] != 0) {
+        // somebody beat us to it
+        PhysMem::dealloc_frame(pa);
+    } else {
+        frames[i] = pa;
+    }
+    return frames[i];
+}
+
+namespace {
+    constexpr uint32_t NSHM = 16;
+    constexpr uint32_t NAME_LENGTH = 32;
+
+    struct Name {
+        char name[NAME_LENGTH];
+        Shared<SharedMemory> shm;
+    };
+
+    Name names[NSHM];
+    BlockingLock names_lock{};
+
+    bool same(const char* a, const char* b) {
+        for (uint32_t i = 0; i < NAME_LENGTH; i++) {
+            if (a[i] != b[i]) return false;
+            if (a[i] == 0) return true;
+        }
+        return true;
+    }
+}
+
+Shared<SharedMemory> SharedMemory::open(const char* name, uint32_t size) {
+    LockGuard g{names_lock};
+    Name* free = nullptr;
+    for (uint32_t i = 0; i < NSHM; i++) {
+        if (names[i].shm == nullptr) {
+            if (free == nullptr) free = &names[i];
+        } else if (same(names[i].name, name)) {
+            return names[i].shm;
+        }
+    }
+    uint32_t n = K::strlen(name);
+    if (free == nullptr || size == 0 || n >= NAME_LENGTH) return Shared<SharedMemory>();
+
+    memcpy(free->name, name, n);
+    free->name[n] = 0;
+    free->shm = Shared<SharedMemory>::make(PhysMem::frameup(size) / PhysMem::FRAME_SIZE);
+    return free->shm;
+}
+
+int SharedMemory::unlink(const char* name) {
+    LockGuard g{names_lock};
+    for (uint32_t i = 0; i < NSHM; i++) {
+        if (names[i].shm != nullptr && same(names[i].name, name)) {
+            names[i].shm = nullptr;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+Shared<SharedMemory> File::getShm() {
+    return Shared<SharedMemory>();
+}
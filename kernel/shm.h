@@ -0,0 +1,54 @@
+#ifndef _shm_h_
+#define _shm_h_
+
+#include "stdint.h"
+#include "shared.h"
+#include "atomic.h"
+#include "file.h"
+#include "physmem.h"
+
+// Shared anonymous memory
+//
+// The frames behind MAP_SHARED anonymous mappings and shm_open handles.
+// Every mapping of the object (in any process) maps the same frames,
+// fork hands them to the child as they are. The PTEs don't own the
+// frames (PTE_SHM), the object gives them back to PhysMem when the last
+// reference to it (VMEntry or descriptor) goes away.
+//
+class SharedMemory {
+    InterruptSafeLock lock{};  // only held to look at frames
+    uint32_t* frames;          // 0 until somebody touches the page
+public:
+    const uint32_t pages;
+
+    explicit SharedMemory(uint32_t pages);
+    ~SharedMemory();
+
+    // The frame of page i, a zeroed one the first time somebody asks.
+    // Returns 0 if we ran out of frames.
+    uint32_t frame(uint32_t i);
+
+    // shm_open: find the named object, or make one of the given size
+    static Shared<SharedMemory> open(const char* name, uint32_t size);
+
+    // Forget the name, the object lives on while it is mapped or open
+    static int unlink(const char* name);
+};
+
+// The descriptor shm_open returns. There is nothing to read or write
+// through it, mmap it instead.
+class SharedMemoryFile : public File {
+    Shared<SharedMemory> shm;
+public:
+    SharedMemoryFile(Shared<SharedMemory> shm) : shm(shm) {}
+    bool isFile() override { return false; }
+    bool isDirectory() override { return false; }
+    off_t size() override { return shm->pages * PhysMem::FRAME_SIZE; }
+    off_t seek(off_t offset) override { return -1; }
+    ssize_t read(void* buf, size_t size) override { return -1; }
+    ssize_t write(void* buf, size_t size) override { return -1; }
+    Shared<Node> getNode() override { return Shared<Node>(); }
+    Shared<SharedMemory> getShm() override { return shm; }
+};
+
+#endif
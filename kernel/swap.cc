@@ -0,0 +1,90 @@
+#include "swap.h"
+#include "ide.h"
+#include "physmem.h"
+#include "debug.h"
+#include "atomic.h"
+#include "libk.h"
+
+namespace Swap {
+
+    // the spare disk: second controller, first channel
+    constexpr uint32_t DRIVE = 2;
+
+    // we don't need more than this
+    constexpr uint32_t MAX_SLOTS = (64 * 1024 * 1024) / PhysMem::FRAME_SIZE;
+
+    constexpr uint32_t SECTORS_PER_SLOT = PhysMem::FRAME_SIZE / 512;
+
+    static Shared<Ide> disk{};
+    static uint32_t* used = nullptr;     // one bit per slot
+    static uint32_t nSlots = 0;
+    static uint32_t nUsed = 0;
+    static uint32_t hint = 0;
+    static uint32_t nOut = 0;
+    static uint32_t nIn = 0;
+    static InterruptSafeLock lock{};
+
+    void init() {
+        auto ide = Shared<Ide>::make(DRIVE);
+        auto sectors = ide->identify();
+        if (sectors < SECTORS_PER_SLOT) {
+            Debug::printf("| no swap disk\n");
+            return;
+        }
+        nSlots = K::min(sectors / SECTORS_PER_SLOT, MAX_SLOTS);
+        used = new uint32_t[(nSlots + 31) / 32]();
+        disk = ide;
+        Debug::printf("| swap disk with %d slots\n",nSlots);
+    }
+
+    bool present() {
+        return nSlots != 0;
+    }
+
+    static bool alloc(uint32_t& slot) {
+        LockGuard g{lock};
+        if (nUsed == nSlots) return false;
+        for (uint32_t i = 0; i < nSlots; i++) {
+            auto s = hint + i;
+            if (s >= nSlots) s -= nSlots;
+            auto bit = uint32_t(1) << (s % 32);
+            if ((used[s / 32] & bit) == 0) {
+                used[s / 32] |= bit;
+                nUsed += 1;
+                hint = s + 1;
+                slot = s;
+                return true;
+            }
+        }
+        Debug::panic("swap bitmap is inconsistent, nUsed:%d\n",nUsed);
+        return false;
+    }
+
+    bool out(uint32_t pa, uint32_t& slot) {
+        if (!present() || !alloc(slot)) return false;
+        auto cnt = disk->write_all(slot * PhysMem::FRAME_SIZE, PhysMem::FRAME_SIZE, (const char*) pa);
+        ASSERT(cnt == PhysMem::FRAME_SIZE);
+        nOut += 1;
+        return true;
+    }
+
+    void read(uint32_t slot, uint32_t pa) {
+        ASSERT(slot < nSlots);
+        auto cnt = disk->read_all(slot * PhysMem::FRAME_SIZE, PhysMem::FRAME_SIZE, (char*) pa);
+        ASSERT(cnt == PhysMem::FRAME_SIZE);
+        nIn += 1;
+    }
+
+    void release(uint32_t slot) {
+        LockGuard g{lock};
+        ASSERT(slot < nSlots);
+        auto bit = uint32_t(1) << (slot % 32);
+        ASSERT((used[slot / 32] & bit) != 0);
+        used[slot / 32] &= ~bit;
+        nUsed -= 1;
+    }
+
+    void stats() {
+        Debug::printf("| swap: %d/%d slots used, %d out, %d in\n",nUsed,nSlots,nOut,nIn);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _swap_h_
+#define _swap_h_
+
+#include "stdint.h"
+
+// Swap space for anonymous pages
+//
+// We use the spare IDE disk (second controller, first channel) as an
+// array of page-sized slots. A swapped-out page is remembered in its
+// (non-present) PTE as (slot << 12) | PTE_SWAP.
+//
+namespace Swap {
+
+    // Called once (on the initial core), finds the swap disk
+    void init();
+
+    // Do we have a swap disk?
+    bool present();
+
+    // Write the frame to a free slot. Returns false if there is no
+    // swap disk or it is full
+    bool out(uint32_t pa, uint32_t& slot);
+
+    // Read the given slot into the frame. The slot stays allocated
+    void read(uint32_t slot, uint32_t pa);
+
+    // Give the slot back
+    void release(uint32_t slot);
+
+    void stats();
+}
+
+#endif
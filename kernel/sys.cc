@@ -12,6 +12,11 @@
 #include "heap.h"
 #include "shared.h"
 #include "kernel.h"
+#include "physmem.h"
+#include "swap.h"
+#include "shm.h"
+#include "buffer_cache.h"
+#include "pit.h"
 
 class FileDescriptor : public File {
     Shared<Node> node;
@@ -42,6 +47,32 @@ public:
 };
 
 
+// Can the kernel copy "bytes" bytes to or from the user pointer "ptr"?
+// The range has to be mapped in user space and stay clear of the APIC
+// pages.
+static bool user_buffer(const void* ptr, uint32_t bytes) {
+    uint32_t start = (uint32_t) ptr;
+    uint32_t end = start + bytes;
+    if (start < 0x80000000 || end < start) return false;
+    if (kConfig.ioAPIC >= start && kConfig.ioAPIC < end) return false;
+    if (kConfig.localAPIC >= start && kConfig.localAPIC < end) return false;
+    return VMM::mapped(start, end);
+}
+
+// Is there a NUL terminated string at the user pointer "str"? Looks at
+// one page at a time so the string can end anywhere in a mapping.
+static bool user_string(const char* str) {
+    uint32_t va = (uint32_t) str;
+    while (true) {
+        uint32_t page_end = PhysMem::framedown(va) + PhysMem::FRAME_SIZE;
+        if (page_end == 0 || !user_buffer((void*) va, page_end - va)) return false;
+        for (; va < page_end; va++) {
+            if (*((char*) va) == 0) return true;
+        }
+    }
+}
+
+
 int SYS::exec(const char* path,
               int argc,
               const char* argv[]
@@ -68,8 +99,8 @@ int SYS::exec(const char* path,
 
     uint32_t e = ELF::load(file);
 
-    // mmap stack
-    VMM::mmap((uint32_t *) (sp - 4000000), 4000000, 0xa ,0x1, -1, 0);
+    // mmap stack (private, MAP_SHARED anonymous memory would be shared with our children)
+    VMM::mmap((uint32_t *) (sp - 4000000), 4000000, 0xa, 0, -1, 0);
 
     uint32_t total_bytes = 12 + (4 * argc);
     uint32_t* lengths = new uint32_t[argc];
@@ -115,7 +146,6 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
     case 0:
         {
             auto status = userEsp[1];
-            current()->process->decrementFiles();
             current()->process->output->set(status);
             stop();
             return 0;
@@ -136,6 +166,7 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
     	{
 		    int id = 0;
             auto child = current()->process->fork(id);
+            if (id < 0) return -1;
             thread(child, [userPC, userEsp]{
                 switchToUser(userPC, (uint32_t) userEsp, 0);
             });
@@ -174,7 +205,7 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
         }
     case 7: /* shutdown */
 		{
-            Debug::shutdown();
+            kernelShutdown();
             return -1;
         }
     case 8: /* wait */
@@ -210,7 +241,7 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
     case 10: /* open */
         {
             char* filename = (char*) userEsp[1];
-            if (filename == nullptr || (uint32_t) filename < 0x80000000) {
+            if (!user_string(filename)) {
                 return -1;
             }
             auto node = root_fs->find(root_fs->root, filename);
@@ -288,6 +319,85 @@ extern "C" int sysHandler(uint32_t eax, uint32_t *frame) {
             int id = (int) userEsp[1];
             return current()->process->kill(id);
         }
+    case 17: /* msync */
+        {
+            void *addr = (void *) userEsp[1];
+            size_t length = (size_t) userEsp[2];
+            int flags = (int) userEsp[3];
+            return VMM::msync(addr, length, flags);
+        }
+    case 18: /* madvise */
+        {
+            void *addr = (void *) userEsp[1];
+            size_t length = (size_t) userEsp[2];
+            int advice = (int) userEsp[3];
+            return VMM::madvise(addr, length, advice);
+        }
+    case 19: /* getrusage */
+        {
+            auto usage = (VMM::Usage*) userEsp[1];
+            if (!user_buffer(usage, sizeof(VMM::Usage))) {
+                return -1;
+            }
+            VMM::Usage u;
+            VMM::usage(u);
+            memcpy(usage, &u, sizeof(u));
+            return 0;
+        }
+    case 20: /* faultstats */
+        {
+            int core = (int) userEsp[1];
+            auto counts = (uint32_t*) userEsp[2];
+            uint32_t bytes = VMM::FAULT_PATHS * VMM::FAULT_BUCKETS * sizeof(uint32_t);
+            if (!user_buffer(counts, bytes)) {
+                return -1;
+            }
+            uint32_t copy[VMM::FAULT_PATHS * VMM::FAULT_BUCKETS];
+            auto n = VMM::fault_histogram(core, copy);
+            if (n < 0) return -1;
+            memcpy(counts, copy, bytes);
+            return n;
+        }
+    case 21: /* shm_open */
+        {
+            char* name = (char*) userEsp[1];
+            size_t size = (size_t) userEsp[2];
+            if (!user_string(name)) {
+                return -1;
+            }
+            auto shm = SharedMemory::open(name, size);
+            if (shm == nullptr) {
+                return -1;
+            }
+            Shared<File> file{new SharedMemoryFile(shm)};
+            return current()->process->setFile(file);
+        }
+    case 22: /* shm_unlink */
+        {
+            char* name = (char*) userEsp[1];
+            if (!user_string(name)) {
+                return -1;
+            }
+            return SharedMemory::unlink(name);
+        }
+    case 23: /* heapstats */
+        {
+            auto stats = (HeapStats*) userEsp[1];
+            if (!user_buffer(stats, sizeof(HeapStats))) {
+                return -1;
+            }
+            HeapStats st;
+            heapStats(st);
+            memcpy(stats, &st, sizeof(st));
+            return 0;
+        }
+    case 24: /* sleep */
+        {
+            uint32_t ms = userEsp[1];
+            auto perSecond = Pit::secondsToJiffies(1);
+            Pit::sleep((ms / 1000) * perSecond + (ms % 1000) * perSecond / 1000);
+            return 0;
+        }
     default:
         {
             Debug::printf("*** 1000000000 unknown system call %d\n",eax);
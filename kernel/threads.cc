@@ -30,7 +30,9 @@ namespace gheith {
 
     void entry() {
         auto me = current();
-        vmm_on((uint32_t)me->process->pd);
+        if (me->saveArea.cr3 != 0) {
+            vmm_on(me->saveArea.cr3);
+        }
         sti();
         me->doYourThing();
         stop();
@@ -65,7 +67,9 @@ namespace gheith {
         isIdle(isIdle), id(next_id.fetch_add(1)), process{process}
     {
         saveArea.tcb = this;
-        saveArea.cr3 = (uint32_t) process->pd;
+        // Kernel-only threads never touch user memory, they run on whatever
+        // address space the core has loaded (0 tells contextSwitch)
+        saveArea.cr3 = (process == Process::kernelProcess) ? 0 : (uint32_t) process->pd;
     }
 
     TCB::~TCB() {
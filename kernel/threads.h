@@ -8,6 +8,7 @@
 #include "smp.h"
 #include "shared.h"
 #include "vmm.h"
+#include "physmem.h"
 #include "tss.h"
 #include "priority_queue.h"
 
@@ -106,7 +107,10 @@ namespace gheith {
                 ASSERT(!Interrupts::isDisabled());
                 ASSERT(me == idleThreads[core_id]);
                 ASSERT(me == activeThreads[core_id]);
-                iAmStuckInALoop(true);
+                // nothing to run, get frames ready for page faults
+                if (!PhysMem::zero_one()) {
+                    iAmStuckInALoop(true);
+                }
                 goto again;
             }
             next_tcb = idleThreads[core_id];    
@@ -117,6 +121,9 @@ namespace gheith {
         activeThreads[core_id] = next_tcb;  // Why is this safe?
 
         tss[core_id].esp0 = next_tcb->interruptEsp();
+        if (next_tcb->saveArea.cr3 != 0) {
+            note_cr3(core_id, next_tcb->saveArea.cr3);
+        }
         gheith_contextSwitch(&me->saveArea,&next_tcb->saveArea,(void *)caller<F>,(void*)&f);
     }
 
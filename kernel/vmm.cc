@@ -10,6 +10,8 @@
 #include "physmem.h"
 #include "process.h"
 #include "priority_queue.h"
+#include "pit.h"
+#include "swap.h"
 
 
 namespace gheith {
@@ -17,117 +19,1189 @@ namespace gheith {
     using namespace PhysMem;
 
     uint32_t* shared = nullptr;
-    NodeEntry* node_list = nullptr;
 
-    void map(uint32_t* pd, uint32_t va, uint32_t pa) {
-        auto pdi = va >> 22;
-        auto pti = (va >> 12) & 0x3FF;
-        auto pde = pd[pdi];
-        if ((pde & 1) == 0) {
-            pde = PhysMem::alloc_frame() | 7;
-            pd[pdi] = pde;
+    // A frame full of zeros. Read faults on anonymous memory map it
+    // read-only, the first write gets a frame of its own.
+    uint32_t zero_page = 0;
+
+    // The page cache. Every entry is on one of two lists: the pages
+    // somebody maps, and the pages nobody maps anymore. Those are clean
+    // (or being written) and stay around in case somebody maps them
+    // again, oldest first. They are the first thing we give up when we
+    // run out of frames. Entries are also hashed by (inode, offset) and
+    // by frame so faults don't have to look through the lists.
+    struct PageList {
+        NodeEntry* first = nullptr;
+        NodeEntry* last = nullptr;
+
+        void append(NodeEntry* e) {
+            e->next = nullptr;
+            e->prev = last;
+            if (last == nullptr) {
+                first = e;
+            } else {
+                last->next = e;
+            }
+            last = e;
+        }
+
+        void remove(NodeEntry* e) {
+            if (e->prev == nullptr) {
+                first = e->next;
+            } else {
+                e->prev->next = e->next;
+            }
+            if (e->next == nullptr) {
+                last = e->prev;
+            } else {
+                e->next->prev = e->prev;
+            }
+            e->prev = nullptr;
+            e->next = nullptr;
+        }
+    };
+
+    static PageList mapped_pages;
+    static PageList cached_pages;
+
+    // allocated in global_init, a bucket per 4 frames of memory
+    static NodeEntry** page_hash = nullptr;
+    static NodeEntry** frame_hash = nullptr;
+    static uint32_t hash_mask = 0;
+
+    // protects the lists, the hash tables, and the NodeEntries on them
+    BlockingLock cache_lock{};
+
+    // Only one write back at a time, so an msync that finds a page clean
+    // knows nobody is still writing it. Taken before cache_lock
+    BlockingLock writeback_lock{};
+
+    // write backs collect this many dirty pages at a time
+    constexpr uint32_t WRITEBACK_BATCH = 32;
+
+    // how often the flusher writes dirty shared pages back
+    constexpr uint32_t FLUSH_SECONDS = 1;
+
+    // The address spaces with MAP_SHARED file mappings, the flusher
+    // harvests their dirty bits. spaces_lock also keeps their page tables
+    // around while it looks (delete_private frees them under it). Taken
+    // before writeback_lock
+    struct Space {
+        uint32_t* pd;
+        Space* next;
+    };
+    static Space* spaces = nullptr;
+    BlockingLock spaces_lock{};
+
+    // how many pages of a file mapping we read into the page cache ahead
+    // of a fault
+    constexpr uint32_t READAHEAD_NORMAL = 2;
+    constexpr uint32_t READAHEAD_SEQUENTIAL = 16;
+
+    // MAP_POPULATE reads (and allocates) this many pages at a time
+    constexpr uint32_t POPULATE_BATCH = 16;
+
+    // Page fault latency histograms, each core only updates its own
+    struct FaultHistogram {
+        uint32_t counts[VMM::FAULT_PATHS][VMM::FAULT_BUCKETS];
+    };
+    static PerCPU<FaultHistogram> fault_histograms;
+
+    void record_fault(uint32_t path, uint64_t start) {
+        auto cycles = rdtsc() - start;
+        uint32_t bucket = (cycles >> 32) ? 31 : 31 - __builtin_clz(uint32_t(cycles) | 1);
+        auto was = Interrupts::disable();
+        fault_histograms.mine().counts[path][bucket]++;
+        Interrupts::restore(was);
+    }
+
+    static uint32_t page_bucket(uint32_t number, uint32_t offset) {
+        return ((number * 2654435761u) ^ (offset >> 12)) & hash_mask;
+    }
+
+    static uint32_t frame_bucket(uint32_t pa) {
+        return (pa >> 12) & hash_mask;
+    }
+
+    // The entry for (file, offset) on either list, nullptr if there is
+    // none. The caller holds cache_lock for all of these
+    NodeEntry* find_page(uint32_t number, uint32_t offset) {
+        for (auto e = page_hash[page_bucket(number, offset)]; e != nullptr; e = e->page_next) {
+            if (e->file->number == number && e->offset == offset) return e;
+        }
+        return nullptr;
+    }
+
+    NodeEntry* find_frame(uint32_t pa) {
+        for (auto e = frame_hash[frame_bucket(pa)]; e != nullptr; e = e->frame_next) {
+            if (e->pa == pa) return e;
+        }
+        return nullptr;
+    }
+
+    // A new entry goes on the list that matches its number of mappings
+    void add_page(NodeEntry* e) {
+        auto& p = page_hash[page_bucket(e->file->number, e->offset)];
+        e->page_next = p;
+        p = e;
+        auto& f = frame_hash[frame_bucket(e->pa)];
+        e->frame_next = f;
+        f = e;
+        if (e->num_mappings == 0) {
+            cached_pages.append(e);
+        } else {
+            mapped_pages.append(e);
         }
+    }
+
+    static void remove_page(NodeEntry* e) {
+        auto pp = &page_hash[page_bucket(e->file->number, e->offset)];
+        while (*pp != e) pp = &(*pp)->page_next;
+        *pp = e->page_next;
+        auto fp = &frame_hash[frame_bucket(e->pa)];
+        while (*fp != e) fp = &(*fp)->frame_next;
+        *fp = e->frame_next;
+        if (e->num_mappings == 0) {
+            cached_pages.remove(e);
+        } else {
+            mapped_pages.remove(e);
+        }
+    }
+
+    // One more mapping, a cached page is back in use
+    void map_page(NodeEntry* e) {
+        if (e->num_mappings++ == 0) {
+            cached_pages.remove(e);
+            mapped_pages.append(e);
+        }
+    }
+
+    // Free up to n of the oldest cached pages, not the ones a prefetch
+    // is still reading
+    uint32_t drop_cached(uint32_t n) {
+        LockGuard g{cache_lock};
+        uint32_t count = 0;
+        for (auto e = cached_pages.first; e != nullptr && count < n; ) {
+            auto next = e->next;
+            if (e->pins == 0 && e->ready.get()) {
+                ASSERT(!e->dirty);
+                remove_page(e);
+                PhysMem::dealloc_frame(e->pa);
+                delete e;
+                count += 1;
+            }
+            e = next;
+        }
+        return count;
+    }
+
+    // Keep the dirty pages, mark them clean and pin them for write_back.
+    // Returns how many there are. The caller holds cache_lock
+    uint32_t pin_dirty(NodeEntry** pages, uint32_t n) {
+        uint32_t m = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            auto page = pages[i];
+            if (!page->dirty) continue;
+            page->dirty = false;
+            page->pins += 1;
+            pages[m++] = page;
+        }
+        return m;
+    }
+
+    // Write the pinned pages back to their files and unpin them. The
+    // caller holds writeback_lock but not cache_lock, faults go on while
+    // we wait for the disk. We sort by (inode, offset) so each file goes
+    // out as ascending runs of adjacent pages and the drive's cache is
+    // only flushed once per file.
+    void write_back(NodeEntry** pages, uint32_t n) {
+        for (uint32_t i = 1; i < n; i++) {
+            auto it = pages[i];
+            uint32_t j = i;
+            while (j > 0 && (pages[j-1]->file->number > it->file->number ||
+                    (pages[j-1]->file->number == it->file->number && pages[j-1]->offset > it->offset))) {
+                pages[j] = pages[j-1];
+                j--;
+            }
+            pages[j] = it;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            auto page = pages[i];
+            auto file = page->file;
+            auto sz = file->size_in_bytes();
+            if (page->offset < sz) {
+                auto bytes = K::min(PhysMem::FRAME_SIZE, sz - page->offset);
+                auto data = (const char*) page->pa;
+                auto bs = file->block_size;
+                ASSERT(page->offset % bs == 0);
+                // the whole blocks in one go (holes are skipped), then the
+                // part of the last one before the end of the file
+                auto whole = bytes - bytes % bs;
+                bool ok = (whole == 0) || file->write_blocks(page->offset / bs, whole / bs, data);
+                if (whole < bytes && file->write_all(page->offset + whole, bytes - whole, data + whole) < 0) {
+                    ok = false;
+                }
+                if (!ok) {
+                    // we can't allocate blocks for the holes
+                    Debug::printf("| page cache: inode %d has a hole at 0x%x, writes to it are lost\n",
+                        file->number, page->offset);
+                }
+            }
+            if (i + 1 == n || pages[i+1]->file->number != file->number) {
+                file->sync();
+            }
+        }
+
+        LockGuard g{cache_lock};
+        for (uint32_t i = 0; i < n; i++) {
+            pages[i]->pins -= 1;
+        }
+    }
+
+    void share_page(uint32_t pa) {
+        LockGuard g{cache_lock};
+        auto e = find_frame(pa);
+        ASSERT(e != nullptr && e->num_mappings != 0);
+        e->num_mappings++;
+    }
+
+    // Drop a mapping of a page cache frame. The last one moves the page
+    // to the cached list and writes it back (if needed).
+    void release_page(uint32_t pa, bool dirty) {
+        NodeEntry* e;
+        {
+            LockGuard g{cache_lock};
+            e = find_frame(pa);
+            ASSERT(e != nullptr);
+            if (dirty) e->dirty = true;
+            if (e->num_mappings > 1) {
+                e->num_mappings--;
+                return;
+            }
+            mapped_pages.remove(e);
+            e->num_mappings = 0;
+            cached_pages.append(e);
+            if (pin_dirty(&e, 1) == 0) return;
+        }
+        LockGuard g{writeback_lock};
+        write_back(&e, 1);
+    }
+
+    // Give back whatever the (already cleared) PTE was pointing at
+    void drop_frame(uint32_t pte) {
+        auto frame = pte & 0xFFFFF000;
+        if ((pte & 1) == 0) {
+            ASSERT(pte & PTE_SWAP);
+            Swap::release(pte >> 12);
+        } else if (frame == zero_page) {
+            // never freed
+        } else if (pte & PTE_SHM) {
+            // the SharedMemory object frees it
+        } else if (pte & PTE_SHARED) {
+            release_page(frame, (pte & PTE_DIRTY) != 0);
+        } else {
+            PhysMem::dealloc_frame(frame);
+        }
+    }
+
+    // Which page directory each core has loaded (its CR3). Only those
+    // cores can have TLB entries for it.
+    static PerCPU<uint32_t> loaded;
+
+    void note_cr3(uint32_t core, uint32_t cr3) {
+        __atomic_store_n(&loaded.forCPU(core), cr3, __ATOMIC_SEQ_CST);
+    }
+
+    // Above this many pages a shootdown flushes the whole TLB instead
+    constexpr uint32_t FULL_FLUSH_PAGES = 32;
+
+    // The shootdown in progress, we do one at a time
+    BlockingLock shootdown_lock{};
+    static volatile uint32_t sd_pd;
+    static volatile uint32_t sd_start;
+    static volatile uint32_t sd_end;
+    static volatile bool sd_drop;        // stop borrowing sd_pd, it's going away
+    static Atomic<uint32_t> sd_pending{0};
+
+    // Kernel-only threads run on whatever address space the core has
+    // loaded. Before a page directory is freed every core still using it
+    // moves to the kernel's. Interrupts are disabled.
+    static void stop_borrowing(uint32_t pd) {
+        if (getCR3() != pd) return;
+        auto kernel_pd = (uint32_t) Process::kernelProcess->pd;
+        note_cr3(SMP::me(), kernel_pd);
+        vmm_on(kernel_pd);
+    }
+
+    // Drop this core's TLB entries for [start,end) of pd
+    static void invalidate(uint32_t pd, uint32_t start, uint32_t end) {
+        // if we switched away, loading the new CR3 took care of it
+        if (getCR3() != pd) return;
+        if ((end - start) / FRAME_SIZE > FULL_FLUSH_PAGES) {
+            vmm_on(pd);    // reloading CR3 drops all the user entries
+        } else {
+            for (uint32_t va = start; va < end; va += FRAME_SIZE) {
+                invlpg(va);
+            }
+        }
+    }
+
+    void shootdown(uint32_t* pd, uint32_t start, uint32_t end) {
+        if (start >= end) return;
+
+        LockGuard g{shootdown_lock};
+
+        auto was = Interrupts::disable();
+        auto me = SMP::me();
+
+        invalidate(uint32_t(pd), start, end);
+
+        // the PTE changes are visible before we look for other users
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        uint32_t targets = 0;
+        for (uint32_t id = 0; id < kConfig.totalProcs; id++) {
+            if (id == me) continue;
+            if (__atomic_load_n(&loaded.forCPU(id), __ATOMIC_SEQ_CST) != uint32_t(pd)) continue;
+            targets |= 1 << id;
+        }
+
+        if (targets != 0) {
+            sd_pd = uint32_t(pd);
+            sd_start = start;
+            sd_end = end;
+            sd_drop = false;
+            for (uint32_t id = 0; id < kConfig.totalProcs; id++) {
+                if (targets & (1 << id)) sd_pending.add_fetch(1);
+            }
+            for (uint32_t id = 0; id < kConfig.totalProcs; id++) {
+                if (targets & (1 << id)) SMP::ipi(id, TLB_VECTOR);
+            }
+            while (sd_pending.get() != 0) {
+                pause();
+            }
+        }
+
+        Interrupts::restore(was);
+    }
+
+    // Make sure no core has pd loaded anymore
+    void release_pd(uint32_t* pd) {
+        LockGuard g{shootdown_lock};
+
+        auto was = Interrupts::disable();
+        auto me = SMP::me();
+        stop_borrowing(uint32_t(pd));
+
+        // A core can note pd right before it loads it, keep asking until
+        // nobody has it
+        while (true) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            uint32_t targets = 0;
+            for (uint32_t id = 0; id < kConfig.totalProcs; id++) {
+                if (id == me) continue;
+                if (__atomic_load_n(&loaded.forCPU(id), __ATOMIC_SEQ_CST) != uint32_t(pd)) continue;
+                targets |= 1 << id;
+            }
+            if (targets == 0) break;
+
+            sd_pd = uint32_t(pd);
+            sd_drop = true;
+            for (uint32_t id = 0; id < kConfig.totalProcs; id++) {
+                if (targets & (1 << id)) sd_pending.add_fetch(1);
+            }
+            for (uint32_t id = 0; id < kConfig.totalProcs; id++) {
+                if (targets & (1 << id)) SMP::ipi(id, TLB_VECTOR);
+            }
+            while (sd_pending.get() != 0) {
+                pause();
+            }
+        }
+
+        Interrupts::restore(was);
+    }
+
+    // Collects cleared PTEs (and page tables) and frees what they point
+    // at in batches. If the address space is live (pd != nullptr) the
+    // stale TLB entries are shot down first, once per batch, for the
+    // range the batch covers. shootdown decides between invlpg and a
+    // full flush.
+    struct FrameBatch {
+        static constexpr uint32_t SIZE = 64;
+        uint32_t* pd;
+        uint32_t ptes[SIZE];
+        uint32_t n = 0;
+        uint32_t start = 0xFFFFFFFF;    // [start,end) of what we cleared
+        uint32_t end = 0;
+
+        FrameBatch(uint32_t* pd) : pd(pd) {}
+
+        // pte was mapping [va,va+bytes), a page table maps 4MB
+        void add(uint32_t pte, uint32_t va = 0, uint32_t bytes = FRAME_SIZE) {
+            ptes[n++] = pte;
+            if (pd != nullptr) {
+                auto last = va + bytes;
+                start = K::min(start, va);
+                end = K::max(end, (last == 0) ? 0xFFFFF000 : last);
+            }
+            if (n == SIZE) flush();
+        }
+
+        void flush() {
+            if (n == 0) return;
+            if (pd != nullptr) {
+                shootdown(pd, start, end);
+                start = 0xFFFFFFFF;
+                end = 0;
+            }
+
+            uint32_t frames[SIZE];
+            uint32_t m = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                auto pte = ptes[i];
+                auto frame = pte & 0xFFFFF000;
+                // shared file pages and shm frames aren't ours to free
+                if ((pte & 1) && ((pte & (PTE_SHARED | PTE_SHM)) == 0) && (frame != zero_page)) {
+                    frames[m++] = frame;
+                } else {
+                    drop_frame(pte);
+                }
+            }
+            PhysMem::dealloc_frames(frames, m);
+            n = 0;
+        }
+
+        ~FrameBatch() {
+            flush();
+        }
+    };
+
+    uint32_t* pte_of(uint32_t* pd, uint32_t va) {
+        auto pde = pd[va >> 22];
+        if ((pde & 1) == 0) return nullptr;
         auto pt = (uint32_t*) (pde & 0xFFFFF000);
-        pt[pti] = pa | 3;
+        return &pt[(va >> 12) & 0x3FF];
+    }
+
+    // Move the hardware dirty bits of the shared pages in [start,end)
+    // to their page cache entries and shoot down the TLB entries we
+    // changed. The address space doesn't have to be loaded (the flusher's
+    // never is), another core might be writing while we clear the bits.
+    void harvest(uint32_t* pd, uint32_t start, uint32_t end) {
+        LockGuard g{cache_lock};
+        uint32_t first = end;
+        uint32_t last = start;
+        uint32_t va = start;
+        while (va < end) {
+            auto ptep = pte_of(pd, va);
+            if (ptep == nullptr) {
+                // no page table, on to the next one
+                auto next = (va | 0x3FFFFF) + 1;
+                if (next == 0) break;
+                va = next;
+                continue;
+            }
+            auto pte = *ptep;
+            if ((pte & (1 | PTE_SHARED | PTE_DIRTY)) == (1 | PTE_SHARED | PTE_DIRTY)) {
+                // an unmap racing with us still needs cache_lock to let go
+                // of the frame, as long as the PTE had it we can mark it
+                pte = __atomic_fetch_and(ptep, ~PTE_DIRTY, __ATOMIC_SEQ_CST);
+                if ((pte & (1 | PTE_SHARED | PTE_DIRTY)) == (1 | PTE_SHARED | PTE_DIRTY)) {
+                    first = K::min(first, va);
+                    last = va + PhysMem::FRAME_SIZE;
+                    find_frame(pte & 0xFFFFF000)->dirty = true;
+                }
+            }
+            va += PhysMem::FRAME_SIZE;
+            if (va == 0) break;
+        }
+        shootdown(pd, first, last);
+    }
+
+    void track_dirty(uint32_t* pd) {
+        LockGuard g{spaces_lock};
+        for (auto s = spaces; s != nullptr; s = s->next) {
+            if (s->pd == pd) return;
+        }
+        spaces = new Space{pd, spaces};
+    }
+
+    static void untrack_dirty(uint32_t* pd) {
+        LockGuard g{spaces_lock};
+        Space** link = &spaces;
+        while (*link != nullptr) {
+            auto s = *link;
+            if (s->pd == pd) {
+                *link = s->next;
+                delete s;
+                return;
+            }
+            link = &s->next;
+        }
+    }
+
+    // The flusher's half of msync: the dirty bits of every tracked
+    // address space go to the page cache
+    static void harvest_spaces() {
+        LockGuard g{spaces_lock};
+        for (auto s = spaces; s != nullptr; s = s->next) {
+            harvest(s->pd, 0x80000000, 0xFFFFF000);
+        }
+    }
+
+    // Write back the dirty shared pages mapped in [start,end), a batch
+    // at a time
+    void sync_range(uint32_t* pd, uint32_t start, uint32_t end) {
+        LockGuard w{writeback_lock};
+        NodeEntry* pages[WRITEBACK_BATCH];
+        uint32_t va = start;
+        while (va < end) {
+            uint32_t n = 0;
+            {
+                LockGuard g{cache_lock};
+                for (; va < end && n < WRITEBACK_BATCH; va += PhysMem::FRAME_SIZE) {
+                    auto ptep = pte_of(pd, va);
+                    if (ptep == nullptr) continue;
+                    auto pte = *ptep;
+                    if ((pte & (1 | PTE_SHARED)) != (1 | PTE_SHARED)) continue;
+                    pages[n++] = find_frame(pte & 0xFFFFF000);
+                }
+                n = pin_dirty(pages, n);
+            }
+            write_back(pages, n);
+        }
     }
 
-    void user_map(uint32_t* pd, uint32_t va, uint32_t pa) {
+    // Write back every dirty page in the page cache. The cached list
+    // never has any, release_page writes them on the way there
+    void flush_dirty() {
+        LockGuard w{writeback_lock};
+        NodeEntry* pages[WRITEBACK_BATCH];
+        while (true) {
+            uint32_t n = 0;
+            {
+                LockGuard g{cache_lock};
+                for (auto e = mapped_pages.first; e != nullptr && n < WRITEBACK_BATCH; e = e->next) {
+                    if (e->dirty) pages[n++] = e;
+                }
+                n = pin_dirty(pages, n);
+            }
+            if (n == 0) return;
+            write_back(pages, n);
+        }
+    }
+
+    // returns false if we couldn't get a frame for the page table
+    bool map(uint32_t* pd, uint32_t va, uint32_t pa) {
         auto pdi = va >> 22;
         auto pti = (va >> 12) & 0x3FF;
         auto pde = pd[pdi];
         if ((pde & 1) == 0) {
-            pde = PhysMem::alloc_frame() | 7;
+            auto pt = PhysMem::alloc_frame();
+            if (pt == 0) return false;
+            pde = pt | 7;
             pd[pdi] = pde;
         }
         auto pt = (uint32_t*) (pde & 0xFFFFF000);
-        pt[pti] = pa | 7;
+        pt[pti] = pa | 3;
+        return true;
     }
 
-    void unmap(uint32_t* pd, uint32_t va, bool physical) {
+    // Only for page faults, we can reclaim frames for the page table
+    bool user_map(uint32_t* pd, uint32_t va, uint32_t pa, uint32_t flags = 7) {
         auto pdi = va >> 22;
         auto pti = (va >> 12) & 0x3FF;
         auto pde = pd[pdi];
-        if ((pde & 1) == 0) return;
-        auto pt = (uint32_t*) (pd[pdi] & 0xFFFFF000);
-        auto pte = pt[pti];
-        if ((pte & 1) == 0) return;
-        auto pa = pte & 0xFFFFF000;
-        pt[pti] = 0;
-        if (physical) {
-            dealloc_frame(pa);
+        if ((pde & 1) == 0) {
+            auto pt = PhysMem::alloc_frame(true, true);
+            if (pt == 0) return false;
+            pde = pt | 7;
+            pd[pdi] = pde;
         }
-        invlpg(va);
+        auto pt = (uint32_t*) (pde & 0xFFFFF000);
+        pt[pti] = pa | flags;
+        return true;
     }
 
+    // Clear the PTE for va and return what it was. The caller deals with
+    // the TLB and the frame.
     bool is_special(uint32_t va) {
         return (va < 0x80000000) || (va == kConfig.ioAPIC) || (va == kConfig.localAPIC);
     }
 
+    // returns nullptr if we ran out of frames
     uint32_t* make_pd() {
         auto pd = (uint32_t*) PhysMem::alloc_frame();
+        if (pd == nullptr) return nullptr;
 
         auto m4 = 4 * 1024 * 1024;
         auto shared_size = 4 * (((kConfig.memSize + m4 - 1) / m4));
 
         memcpy(pd,shared,shared_size);
 
-        map(pd,kConfig.ioAPIC,kConfig.ioAPIC);
-        map(pd,kConfig.localAPIC,kConfig.localAPIC);
+        if (!map(pd,kConfig.ioAPIC,kConfig.ioAPIC) || !map(pd,kConfig.localAPIC,kConfig.localAPIC)) {
+            delete_pd(pd, nullptr);
+            return nullptr;
+        }
 
         return pd;
     }
 
-    void delete_private(uint32_t* pd) {
+    bool holds_special(uint32_t pdi) {
+        return (pdi == (kConfig.ioAPIC >> 22)) || (pdi == (kConfig.localAPIC >> 22));
+    }
+
+    // Clear the PTEs of every VMEntry range and hand them to the batch.
+    // Missing page tables are skipped 4MB at a time so the cost follows
+    // what was populated, not how big the ranges are. We yield between
+    // page tables when we can, a big address space takes a while.
+    void drop_ranges(uint32_t* pd, VMEntry* entries, FrameBatch& batch) {
+        for (auto e = entries; e != nullptr; e = e->next) {
+            uint32_t va = e->starting_address;
+            uint32_t left = e->size / FRAME_SIZE;
+            while (left > 0) {
+                auto pdi = va >> 22;
+                auto pti = (va >> 12) & 0x3FF;
+                auto n = K::min(left, 1024 - pti);
+                auto pde = pd[pdi];
+                if (pde & 1) {
+                    auto pt = (uint32_t*)(pde & 0xFFFFF000);
+                    bool special = holds_special(pdi);
+                    for (uint32_t i = 0; i < n; i++) {
+                        auto pte = pt[pti + i];
+                        if (pte == 0) continue;
+                        if (special && is_special(va + i * FRAME_SIZE)) continue;
+                        pt[pti + i] = 0;
+                        batch.add(pte, va + i * FRAME_SIZE);
+                    }
+                    if (!Interrupts::isDisabled()) yield();
+                }
+                va += n * FRAME_SIZE;
+                left -= n;
+            }
+        }
+    }
+
+    // Tear down the user part of the current address space (exec). The
+    // page directory itself tells us which page tables are there.
+    void delete_private(uint32_t* pd, VMEntry* entries) {
         ASSERT(uint32_t(pd) == getCR3());
+        FrameBatch batch{pd};
+
+        drop_ranges(pd, entries, batch);
+        batch.flush();
+
+        // the flusher might be walking our page tables
+        LockGuard g{spaces_lock};
+        FrameBatch tables{pd};
         for (unsigned pdi=512; pdi<1024; pdi++) {
             auto pde = pd[pdi];
             if ((pde&1) == 0) continue;
-            auto pt = (uint32_t*)(pde & 0xFFFFF000);
+            if (holds_special(pdi)) continue;
+            pd[pdi] = 0;
+            tables.add((pde & 0xFFFFF000) | 1, pdi << 22, 1 << 22);
+        }
+    }
 
-            bool contains_special = false;
+    void delete_pd(uint32_t* pd, VMEntry* entries) {
+        // the reaper (or another kernel thread) might still be borrowing it
+        release_pd(pd);
+        ASSERT(uint32_t(pd) != getCR3());
+        untrack_dirty(pd);
+        FrameBatch batch{nullptr};   // nobody has it loaded
 
-            for (unsigned pti=0; pti<1024; pti++) {
-                auto va = (pdi << 22) | (pti << 12);
-                if (is_special(va)) {
-                    contains_special = true;
-                    continue;
-                }
+        drop_ranges(pd, entries, batch);
+
+        for (unsigned pdi=512; pdi<1024; pdi++) {
+            auto pde = pd[pdi];
+            if ((pde&1) == 0) continue;
+            batch.add((pde & 0xFFFFF000) | 1);
+        }
+
+        batch.add((uint32_t)pd | 1);
+    }
+
+    // One CLOCK (second chance) pass over the user half of the current
+    // address space, starting where the last one stopped. Recently used
+    // pages lose their accessed bit, the others are swapped out (private
+    // pages) or unmapped (shared pages, they end up on the cached list).
+    // Returns the number of frames that went back to PhysMem.
+    //
+    // We only look at the current address space. Clearing an accessed
+    // bit only needs a local invlpg (at worst another core keeps using
+    // the page without setting it again), pages we take away are shot
+    // down everywhere before the frame is reused.
+    uint32_t clock(uint32_t* pd, uint32_t& hand, uint32_t n) {
+        ASSERT(uint32_t(pd) == getCR3());
+
+        uint32_t freed = 0;
+        uint32_t va = hand;
+        bool can_swap = Swap::present();
+
+        // two sweeps: the first might only clear accessed bits
+        for (uint32_t pages = 0; pages < 2 * 512 * 1024 && freed < n; ) {
+            auto pdi = va >> 22;
+            auto pti = (va >> 12) & 0x3FF;
+            auto pde = pd[pdi];
+            uint32_t next = va + FRAME_SIZE;
+
+            if ((pde & 1) == 0) {
+                // skip the whole page table
+                next = (pdi + 1) << 22;
+                pages += 1024 - pti;
+            } else {
+                pages += 1;
+                auto pt = (uint32_t*) (pde & 0xFFFFF000);
                 auto pte = pt[pti];
-                if ((pte&1) == 0) continue;
-                pt[pti] = 0;
                 auto frame = pte & 0xFFFFF000;
-                dealloc_frame(frame);
-                invlpg(va);
+                // shared anonymous pages stay, unmapping them frees nothing
+                if (((pte & 1) == 1) && !is_special(va) && frame != zero_page && (pte & PTE_SHM) == 0) {
+                    if (pte & PTE_ACCESSED) {
+                        pt[pti] = pte & ~PTE_ACCESSED;
+                        invlpg(va);
+                    } else if (pte & PTE_SHARED) {
+                        pt[pti] = 0;
+                        shootdown(pd, va, va + FRAME_SIZE);
+                        release_page(frame, (pte & PTE_DIRTY) != 0);
+                    } else if (can_swap) {
+                        uint32_t slot;
+                        if (Swap::out(frame, slot)) {
+                            pt[pti] = (slot << 12) | PTE_SWAP;
+                            shootdown(pd, va, va + FRAME_SIZE);
+                            PhysMem::dealloc_frame(frame);
+                            freed += 1;
+                        } else {
+                            can_swap = false;
+                        }
+                    }
+                }
+            }
+            va = (next == 0) ? 0x80000000 : next;
+        }
+
+        hand = va;
+        return freed;
+    }
+
+    // Give the read-only page at *ptep a frame of its own. It was the
+    // zero page or a page cache frame of a private file mapping that
+    // nobody wrote yet. Returns false if we ran out of memory.
+    bool copy_on_write(uint32_t* ptep, uint32_t va) {
+        auto old = *ptep;
+        auto frame = old & 0xFFFFF000;
+        bool zeros = (frame == zero_page);
+        auto pa = PhysMem::alloc_frame(zeros, true);
+        if (pa == 0) return false;
+        if (*ptep != old) {
+            // reclaim took the page while we were getting the frame,
+            // the write faults again
+            PhysMem::dealloc_frame(pa);
+            return true;
+        }
+        if (!zeros) memcpy((void*) pa, (void*) frame, FRAME_SIZE);
+        *ptep = pa | 7;
+        invlpg(va);
+        if (old & PTE_SHARED) release_page(frame, false);
+        return true;
+    }
+
+    // The page cache frame for (file, offset), read in if nobody has it.
+    // pa is a frame the caller got for the read (we never allocate while
+    // holding cache_lock, reclaim needs it), freed if it isn't needed.
+    // Counts one more mapping. Sets *major if it had to read the file.
+    // The read happens outside cache_lock, other faults on the page wait
+    // until it's ready
+    uint32_t cache_page(Shared<Node> file, uint32_t offset, uint32_t pa, bool* major) {
+        NodeEntry* node_entry;
+        bool mine = false;
+        {
+            LockGuard g{cache_lock};
+            node_entry = find_page(file->number, offset);
+            if (node_entry != nullptr) {
+                PhysMem::dealloc_frame(pa);
+                map_page(node_entry);
+            } else {
+                node_entry = new NodeEntry(file, offset, pa);
+                node_entry->ready.set(false);
+                add_page(node_entry);
+                mine = true;
             }
-            if (!contains_special) {
-                pd[pdi] = 0;
-                dealloc_frame((uint32_t)pt);
+        }
+
+        if (!mine) {
+            // our mapping keeps it around while we wait
+            while (!node_entry->ready.get()) yield();
+            return node_entry->pa;
+        }
+
+        // Page has not been mapped yet. We will read it in.
+        if (major != nullptr) *major = true;
+        auto read = file->read_all(offset, PhysMem::FRAME_SIZE, (char*) pa);
+        if (read != PhysMem::FRAME_SIZE) {
+            if (read == -1) read = 0;
+            bzero((char*) pa + read, PhysMem::FRAME_SIZE - read);
+        }
+        node_entry->ready.set(true);
+        return pa;
+    }
+
+    // the most pages read_pages and prefetch read at once
+    constexpr uint32_t MAX_READ_PAGES = 16;
+
+    // The pieces of a read of n pages of the file at offset into the
+    // given frames: whole blocks, up to the end of the file. Returns how
+    // many, bytes gets how much of the file they hold
+    static uint32_t page_pieces(Shared<Node>& file, uint32_t offset, const uint32_t* frames, uint32_t n,
+            BlockIO::IOVec* vec, uint32_t& bytes) {
+        ASSERT(n <= MAX_READ_PAGES);
+        auto bs = file->block_size;
+        ASSERT(FRAME_SIZE % bs == 0);
+
+        auto size = file->size_in_bytes();
+        bytes = (offset >= size) ? 0 : K::min(n * FRAME_SIZE, size - offset);
+        // whole blocks, the end of the last one is past the end of the file
+        uint32_t left = ((bytes + bs - 1) / bs) * bs;
+
+        uint32_t m = 0;
+        for (; m < n && left > 0; m++) {
+            vec[m].buffer = (char*) frames[m];
+            vec[m].bytes = K::min(FRAME_SIZE, left);
+            left -= vec[m].bytes;
+        }
+        return m;
+    }
+
+    // Zero what the frames have past the first bytes of file data
+    static void zero_tail(const uint32_t* frames, uint32_t n, uint32_t bytes) {
+        for (uint32_t k = 0; k < n; k++) {
+            auto start = k * FRAME_SIZE;
+            if (start + FRAME_SIZE <= bytes) continue;
+            auto skip = (bytes > start) ? bytes - start : 0;
+            bzero((char*) frames[k] + skip, FRAME_SIZE - skip);
+        }
+    }
+
+    // Read n pages of the file starting at offset (page aligned) into the
+    // given frames with one scatter-gather request. Whatever is past the
+    // end of the file reads as zeros
+    void read_pages(Shared<Node> file, uint32_t offset, const uint32_t* frames, uint32_t n) {
+        BlockIO::IOVec vec[MAX_READ_PAGES];
+        uint32_t bytes;
+        auto m = page_pieces(file, offset, frames, n, vec, bytes);
+        if (m > 0) file->read_blocks(offset / file->block_size, vec, m);
+        zero_tail(frames, n, bytes);
+    }
+
+    // Make va (in vm_entry) accessible, the way a page fault would.
+    // Returns false if we ran out of memory. Sets *major if it had to
+    // wait for the disk (swap or the file).
+    bool fault_in(uint32_t* pd, VMEntry* vm_entry, uint32_t va, bool write, bool* major = nullptr) {
+        auto pte = pte_of(pd, va);
+        if (pte != nullptr && (*pte & PTE_SWAP)) {
+            // Swapped out, bring it back
+            auto slot = *pte >> 12;
+            auto pa = PhysMem::alloc_frame(false, true);
+            if (pa == 0) return false;
+            if (major != nullptr) *major = true;
+            Swap::read(slot, pa);
+            Swap::release(slot);
+            *pte = pa | 7;
+            return true;
+        }
+
+        if (pte != nullptr && (*pte & 1)) {
+            if (write && (*pte & 2) == 0) {
+                return copy_on_write(pte, va);
             }
+            // stale TLB entry, the PTE is fine now
+            invlpg(va);
+            return true;
+        }
+
+        if (vm_entry->shm != nullptr) {
+            // everybody mapping the object gets the same frame
+            auto pa = vm_entry->shm->frame((vm_entry->offset + va - vm_entry->starting_address) / FRAME_SIZE);
+            if (pa == 0) return false;
+            return user_map(pd, va, pa | PTE_SHM);
         }
+
+        // Only readable file mappings get the file's data. Anonymous memory,
+        // the rest of the file mappings and the part of a private mapping
+        // past its file data (ELF bss) start out as zeros.
+        bool from_file = vm_entry->file != nullptr && (vm_entry->prot & 2) == 2 && va < vm_entry->file_end;
+        bool shared = (vm_entry->flags & 0x1) == 1;
+
+        // Reading memory that was never written, it's all zeros
+        if (!from_file && !write) {
+            return user_map(pd, va, zero_page, 5);
+        }
+
+        // Private pages that don't line up with a page cache page get a
+        // copy of their bytes right away: a segment at an odd file offset,
+        // or a page the file data only covers part of.
+        uint32_t offset = vm_entry->offset + va - vm_entry->starting_address;
+        bool copy = from_file && !shared && (PhysMem::offset(offset) != 0 || vm_entry->file_end - va < FRAME_SIZE);
+
+        // We never allocate while holding cache_lock, reclaim needs it.
+        // Page cache pages get overwritten by the read, no need to zero them.
+        uint32_t pa = PhysMem::alloc_frame(!from_file || copy, true);
+        if (pa == 0) return false;
+        uint32_t flags = 7;
+
+        if (copy) {
+            if (major != nullptr) *major = true;
+            vm_entry->file->read_all(offset, K::min(FRAME_SIZE, vm_entry->file_end - va), (char*) pa);
+        } else if (from_file) {
+            pa = cache_page(vm_entry->file, PhysMem::framedown(offset), pa, major) | PTE_SHARED;
+            // a private mapping shares the frame until it writes to it
+            if (!shared) flags = 5;
+        }
+        if (!user_map(pd, va, pa, flags)) {
+            drop_frame(pa | 1);
+            return false;
+        }
+        if (write && flags == 5) {
+            return copy_on_write(pte_of(pd, va), va);
+        }
+        return true;
     }
 
-    void delete_pd(uint32_t* pd) {
-        ASSERT(uint32_t(pd) != getCR3());
+    // Bring up to n pages of the file at offset into the page cache with
+    // one request, the faults that follow find them there. We don't wait
+    // for the disk: the pages go in right away, not ready until the read
+    // completes (faults on them wait, reclaim leaves them alone). Pages
+    // nobody maps go on the cached list, ready to be reclaimed
+    void prefetch(Shared<Node> file, uint32_t offset, uint32_t n) {
+        n = K::min(n, MAX_READ_PAGES);
 
-        for (unsigned pdi=512; pdi<1024; pdi++) {
+        // the first run of pages the page cache doesn't have
+        uint32_t first = n;
+        uint32_t count = 0;
+        {
+            LockGuard g{cache_lock};
+            for (uint32_t k = 0; k < n; k++) {
+                auto o = offset + k * FRAME_SIZE;
+                if (find_page(file->number, o) == nullptr) {
+                    if (first == n) first = k;
+                    count += 1;
+                } else if (first != n) {
+                    break;
+                }
+            }
+        }
+        if (count < 2) return;      // a fault reads one page just as well
+
+        // on the drive's queue thread once the data is there
+        struct Read : public BlockIO::Completion {
+            NodeEntry* pages[MAX_READ_PAGES];
+            uint32_t frames[MAX_READ_PAGES];
+            uint32_t n = 0;
+            uint32_t bytes = 0;
+
+            void complete() override {
+                zero_tail(frames, n, bytes);
+                // somebody might free a page as soon as it's ready
+                for (uint32_t k = 0; k < n; k++) pages[k]->ready.set(true);
+                delete this;
+            }
+        };
+
+        auto read = new Read();
+        // only free frames, a guess isn't worth pushing other pages out
+        if (!PhysMem::alloc_frames(read->frames, count, false)) {
+            delete read;
+            return;
+        }
+        offset += first * FRAME_SIZE;
+
+        {
+            LockGuard g{cache_lock};
+            // up to a page somebody else started reading in the meantime
+            for (; read->n < count; read->n++) {
+                auto o = offset + read->n * FRAME_SIZE;
+                if (find_page(file->number, o) != nullptr) break;
+                auto e = new NodeEntry(file, o, read->frames[read->n]);
+                e->num_mappings = 0;
+                e->ready.set(false);
+                add_page(e);
+                read->pages[read->n] = e;
+            }
+        }
+        PhysMem::dealloc_frames(read->frames + read->n, count - read->n);
+        if (read->n == 0) {
+            delete read;
+            return;
+        }
+
+        BlockIO::IOVec vec[MAX_READ_PAGES];
+        auto m = page_pieces(file, offset, read->frames, read->n, vec, read->bytes);
+        file->read_blocks_async(offset / file->block_size, vec, m, read);
+    }
+
+    // Read ahead of a fault on a file page, depending on what the program
+    // told us about its access pattern (madvise). The pages only go into
+    // the page cache (cached list), nothing is mapped: a page the
+    // process never touches costs a frame we can take back, not a PTE.
+    // The faults that do come are minor
+    void readahead(VMEntry* vm_entry, uint32_t va) {
+        if (vm_entry->file == nullptr || (vm_entry->prot & 2) == 0) return;
+
+        uint32_t pages;
+        switch (vm_entry->advice) {
+            case VMM::MADV_SEQUENTIAL: pages = READAHEAD_SEQUENTIAL; break;
+            case VMM::MADV_RANDOM: pages = 0; break;
+            default: pages = READAHEAD_NORMAL; break;
+        }
+
+        auto end = K::min(vm_entry->starting_address + vm_entry->size, vm_entry->file_end);
+        auto offset = vm_entry->offset + va - vm_entry->starting_address;
+        if (pages > 0 && va + FRAME_SIZE < end && PhysMem::offset(offset) == 0) {
+            auto n = K::min(pages, (end - va - FRAME_SIZE + FRAME_SIZE - 1) / FRAME_SIZE);
+            prefetch(vm_entry->file, offset + FRAME_SIZE, n);
+        }
+    }
+
+    // Clear the PTEs in [start,end), shoot the range down once, then
+    // give back the frames (the last mapping of a shared page writes it
+    // back)
+    // Clear the PTEs of [start,end), a page table at a time and skipping
+    // the ones that aren't there. The batch shoots down what it clears
+    // before it frees anything
+    void unmap_range(uint32_t* pd, uint32_t start, uint32_t end) {
+        FrameBatch batch{pd};
+        uint32_t va = start;
+        while (va < end) {
+            auto pdi = va >> 22;
+            auto pti = (va >> 12) & 0x3FF;
+            auto n = K::min((end - va) / FRAME_SIZE, 1024 - pti);
             auto pde = pd[pdi];
-            if ((pde&1) == 0) continue;
-            auto pt = (uint32_t*)(pde & 0xFFFFF000);
+            if (pde & 1) {
+                auto pt = (uint32_t*)(pde & 0xFFFFF000);
+                for (uint32_t i = 0; i < n; i++) {
+                    auto pte = pt[pti + i];
+                    if (pte == 0) continue;
+                    pt[pti + i] = 0;
+                    batch.add(pte, va + i * FRAME_SIZE);
+                }
+            }
+            va += n * FRAME_SIZE;
+        }
+    }
 
-            for (unsigned pti=0; pti<1024; pti++) {
-                auto va = (pdi << 22) | (pti << 12);
+    // Make every page of vm_entry resident (MAP_POPULATE). File pages are
+    // read POPULATE_BATCH at a time, one scatter-gather read per batch,
+    // then all the PTEs go in under a single hold of cache_lock. Whatever
+    // that misses is faulted in one by one.
+    void populate(uint32_t* pd, VMEntry* vm_entry) {
+        auto start = vm_entry->starting_address;
+        auto n = vm_entry->size / FRAME_SIZE;
 
-                auto pte = pt[pti];
-                if ((pte&1) == 0) continue;
-                auto frame = pte & 0xFFFFF000;
-                if (!is_special(va)) {
-                    dealloc_frame(frame);
+        // page tables first, we can't allocate under cache_lock
+        for (uint32_t i = 0; i < n; ) {
+            auto va = start + i * FRAME_SIZE;
+            auto pdi = va >> 22;
+            if ((pd[pdi] & 1) == 0) {
+                auto pt = PhysMem::alloc_frame(true, true);
+                if (pt == 0) return;
+                pd[pdi] = pt | 7;
+            }
+            i += 1024 - ((va >> 12) & 0x3FF);
+        }
+
+        bool from_file = vm_entry->file != nullptr && (vm_entry->prot & 2) == 2;
+
+        if (vm_entry->shm != nullptr || (from_file && (vm_entry->flags & 0x1) == 0)) {
+            // the frames of shared anonymous memory belong to the object,
+            // private file mappings get the page cache frames read-only,
+            // the way read faults would
+            for (uint32_t i = 0; i < n; i++) {
+                auto va = start + i * FRAME_SIZE;
+                if (*pte_of(pd, va) != 0) continue;
+                if (!fault_in(pd, vm_entry, va, false)) return;
+            }
+            return;
+        }
+
+        if (!from_file) {
+            // zero-filled frames of its own for every page, no zero page:
+            // the point is to never fault again
+            uint32_t frames[POPULATE_BATCH];
+            for (uint32_t i = 0; i < n; i += POPULATE_BATCH) {
+                auto m = K::min(POPULATE_BATCH, n - i);
+                if (!PhysMem::alloc_frames(frames, m, true, true)) return;
+                for (uint32_t k = 0; k < m; k++) {
+                    auto ptep = pte_of(pd, start + (i + k) * FRAME_SIZE);
+                    if (*ptep == 0) {
+                        *ptep = frames[k] | 7;
+                    } else {
+                        PhysMem::dealloc_frame(frames[k]);
+                    }
                 }
             }
-            dealloc_frame((uint32_t)pt);
+            return;
         }
 
-        PhysMem::dealloc_frame((uint32_t)pd);
+        auto file = vm_entry->file;
+        auto first_offset = PhysMem::framedown(vm_entry->offset);
+        auto frames = new uint32_t[n]();
+
+        for (uint32_t i = 0; i < n; i += POPULATE_BATCH) {
+            auto m = K::min(POPULATE_BATCH, n - i);
+            auto offset = first_offset + i * FRAME_SIZE;
+
+            // nothing to read if the page cache has all of them
+            bool missing = false;
+            {
+                LockGuard g{cache_lock};
+                for (uint32_t k = 0; k < m && !missing; k++) {
+                    auto o = offset + k * FRAME_SIZE;
+                    missing = (find_page(file->number, o) == nullptr);
+                }
+            }
+            if (!missing) continue;
+
+            if (!PhysMem::alloc_frames(&frames[i], m, false, true)) {
+                // it gave them back, don't let the loop below see them
+                bzero(&frames[i], m * sizeof(uint32_t));
+                break;
+            }
+            read_pages(file, offset, &frames[i], m);
+        }
+
+        {
+            LockGuard g{cache_lock};
+            for (uint32_t i = 0; i < n; i++) {
+                auto ptep = pte_of(pd, start + i * FRAME_SIZE);
+                auto offset = first_offset + i * FRAME_SIZE;
+                if (*ptep != 0) {
+                    if (frames[i] != 0) PhysMem::dealloc_frame(frames[i]);
+                    continue;
+                }
+                NodeEntry* node_entry = find_page(file->number, offset);
+                if (node_entry != nullptr) {
+                    // somebody else's copy wins
+                    if (frames[i] != 0) PhysMem::dealloc_frame(frames[i]);
+                    // still being read, the fault_in below waits for it
+                    if (!node_entry->ready.get()) continue;
+                    map_page(node_entry);
+                } else if (frames[i] != 0) {
+                    node_entry = new NodeEntry(file, offset, frames[i]);
+                    add_page(node_entry);
+                } else {
+                    // was cached when we looked, not anymore
+                    continue;
+                }
+                *ptep = node_entry->pa | PTE_SHARED | 7;
+            }
+        }
+        delete[] frames;
+
+        for (uint32_t i = 0; i < n; i++) {
+            auto va = start + i * FRAME_SIZE;
+            if (*pte_of(pd, va) != 0) continue;
+            if (!fault_in(pd, vm_entry, va, false)) return;
+        }
     }
 }
 
@@ -136,10 +1210,40 @@ namespace VMM {
 void global_init() {
     using namespace gheith;
     shared = (uint32_t*) PhysMem::alloc_frame();
+    zero_page = PhysMem::alloc_frame();
+
+    uint32_t buckets = 64;
+    while (buckets * 4 < kConfig.memSize / FRAME_SIZE) buckets *= 2;
+    page_hash = new NodeEntry*[buckets]();
+    frame_hash = new NodeEntry*[buckets]();
+    hash_mask = buckets - 1;
 
     for (uint32_t va = FRAME_SIZE; va < kConfig.memSize; va += FRAME_SIZE) {
         map(shared,va,va);
     }
+
+    IDT::interrupt(TLB_VECTOR, (uint32_t)tlbHandler_);
+}
+
+uint32_t reclaim(uint32_t n) {
+    using namespace gheith;
+
+    // clean file pages first, they cost nothing to get back
+    auto freed = drop_cached(n);
+    if (freed >= n) return freed;
+
+    // then the current process pays with its own pages (kernel threads
+    // don't have any, they borrow somebody else's address space)
+    auto me = current();
+    if (me->saveArea.cr3 != 0) {
+        freed += clock(me->process->pd, me->process->clock_hand, n - freed);
+    }
+
+    // the shared pages clock let go of
+    if (freed < n) {
+        freed += drop_cached(n - freed);
+    }
+    return freed;
 }
 
 void per_core_init() {
@@ -148,6 +1252,7 @@ void per_core_init() {
     Interrupts::protect([] {
         ASSERT(Interrupts::isDisabled());
         auto me = activeThreads[SMP::me()];
+        note_cr3(SMP::me(), (uint32_t)me->process->pd);
         vmm_on((uint32_t)me->process->pd);
     });
 }
@@ -166,7 +1271,6 @@ int munmap(void *addr, size_t len) {
 
         // Found the corresponding entry.
         if (address >= vm_entry->starting_address && address < vm_entry->starting_address + vm_entry->size) {
-            bool physical = true;
 
             // Remove the entry from the process's entry list.
             if (prev == nullptr) {
@@ -174,36 +1278,13 @@ int munmap(void *addr, size_t len) {
             } else {
                 prev->next = vm_entry->next;
             }
+            me->process->mappings--;
 
-            // If a private mapping, it needs to be deallocated from physical memory.
-            if ((vm_entry->flags & 0x1) == 0) {
-                physical = true;
-            } else if (--vm_entry->node->num_processes != 0) {
-                // Only deallocate from physical memory if this is the last process mapped to the file.
-                physical = false;
-            }
-
-            // Unmap from virtual memory.
-            for (uint32_t va = vm_entry->starting_address; va < vm_entry->starting_address + vm_entry->size; va += PhysMem::FRAME_SIZE) {
-                unmap(me->process->pd, va, physical);
-            }
+            // Unmap from virtual memory. We clear all the PTEs and shoot down the
+            // whole range at once. Then private frames are freed, shared ones are
+            // written back and freed by the last mapping.
+            unmap_range(me->process->pd, vm_entry->starting_address, vm_entry->starting_address + vm_entry->size);
 
-            if (physical) {
-                NodeEntry *node_entry = node_list;
-                NodeEntry *next_entry = node_entry->next;
-                if (node_entry->file->number == vm_entry->node->file->number) {
-                    node_list = node_list->next;
-                } else {
-                    while (next_entry != nullptr) {
-                        if (next_entry->file->number == vm_entry->node->file->number) {
-                            node_entry->next = next_entry->next;
-                            break;
-                        }
-                        node_entry = next_entry;
-                        next_entry = next_entry->next;
-                    }
-                }
-            }
             delete vm_entry;
             return 0;
         }
@@ -213,7 +1294,184 @@ int munmap(void *addr, size_t len) {
     return 0;
 }
 
-void *mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+bool mapped(uint32_t start, uint32_t end) {
+    using namespace gheith;
+    // whole pages, the way faults see them: a page belongs to the entry
+    // its first byte is in (the stack doesn't start on a page boundary).
+    // Entries don't overlap
+    start = PhysMem::framedown(start);
+    end = PhysMem::frameup(end);
+    uint32_t covered = 0;
+    for (auto vm_entry = current()->process->entry_list; vm_entry != nullptr; vm_entry = vm_entry->next) {
+        auto from = K::max(start, PhysMem::frameup(vm_entry->starting_address));
+        auto to = K::min(end, PhysMem::frameup(vm_entry->starting_address + vm_entry->size));
+        if (from < to) covered += to - from;
+    }
+    return covered == end - start;
+}
+
+int msync(void *addr, size_t len, int flags) {
+    using namespace gheith;
+    uint32_t start = (uint32_t) addr;
+    uint32_t end = start + PhysMem::frameup(len);
+    if (PhysMem::offset(start) != 0 || is_special(start) || end < start) return -1;
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC)) return -1;
+
+    // the whole range has to be mapped (ENOMEM)
+    if (!mapped(start, end)) return -1;
+
+    auto me = current();
+
+    for (auto vm_entry = me->process->entry_list; vm_entry != nullptr; vm_entry = vm_entry->next) {
+        if (vm_entry->file == nullptr || (vm_entry->flags & 0x1) == 0) continue;
+        auto from = K::max(start, vm_entry->starting_address);
+        auto to = K::min(end, vm_entry->starting_address + vm_entry->size);
+        if (from >= to) continue;
+
+        harvest(me->process->pd, from, to);
+        if (flags & MS_SYNC) {
+            sync_range(me->process->pd, from, to);
+        }
+    }
+
+    // MS_ASYNC: the flusher will get to them
+    return 0;
+}
+
+int madvise(void *addr, size_t len, int advice) {
+    using namespace gheith;
+    uint32_t start = (uint32_t) addr;
+    uint32_t end = start + PhysMem::frameup(len);
+    if (PhysMem::offset(start) != 0 || is_special(start) || end < start) return -1;
+    if (advice < MADV_NORMAL || advice > MADV_DONTNEED) return -1;
+
+    auto me = current();
+    auto pd = me->process->pd;
+
+    for (auto vm_entry = me->process->entry_list; vm_entry != nullptr; vm_entry = vm_entry->next) {
+        auto from = K::max(start, vm_entry->starting_address);
+        auto to = K::min(end, vm_entry->starting_address + vm_entry->size);
+        if (from >= to) continue;
+
+        if (advice == MADV_DONTNEED) {
+            // the next touch gets zeros (anonymous) or the file's data
+            unmap_range(pd, from, to);
+        } else if (advice == MADV_WILLNEED) {
+            // bring in the file pages and whatever is in swap, there is
+            // nothing to prefetch for untouched anonymous memory
+            bool file = vm_entry->file != nullptr && (vm_entry->prot & 2) == 2;
+            for (uint32_t va = from; va < to; va += FRAME_SIZE) {
+                auto pte = pte_of(pd, va);
+                bool swapped = (pte != nullptr) && (*pte & PTE_SWAP);
+                bool missing = (pte == nullptr) || (*pte == 0);
+                if (swapped || (missing && file && va < vm_entry->file_end)) {
+                    if (!fault_in(pd, vm_entry, va, false)) break;
+                }
+            }
+        } else {
+            // the hint covers the whole entry, we don't split them
+            vm_entry->advice = advice;
+        }
+    }
+    return 0;
+}
+
+void start_flusher() {
+    using namespace gheith;
+    thread(Process::kernelProcess, [] {
+        while (true) {
+            Pit::sleep(Pit::secondsToJiffies(FLUSH_SECONDS));
+            harvest_spaces();
+            flush_dirty();
+        }
+    });
+}
+
+void usage(Usage& u) {
+    using namespace gheith;
+    auto process = current()->process;
+    auto pd = process->pd;
+
+    u.anon_pages = 0;
+    u.file_pages = 0;
+    u.shared_pages = 0;
+    u.swap_pages = 0;
+
+    // only the ranges we have entries for, skipping missing page tables
+    for (auto e = process->entry_list; e != nullptr; e = e->next) {
+        uint32_t end = e->starting_address + e->size;
+        for (uint32_t va = e->starting_address; va < end; ) {
+            if ((pd[va >> 22] & 1) == 0) {
+                va = ((va >> 22) + 1) << 22;
+                if (va == 0) break;
+                continue;
+            }
+            auto pte = *pte_of(pd, va);
+            va += FRAME_SIZE;
+            if ((pte & 1) == 0) {
+                if (pte & PTE_SWAP) u.swap_pages++;
+            } else if (is_special(va - FRAME_SIZE) || (pte & 0xFFFFF000) == zero_page) {
+                // not ours
+            } else if ((pte & (PTE_SHARED | PTE_SHM)) == 0) {
+                u.anon_pages++;
+            } else if (pte & (PTE_SHM | 2)) {
+                u.shared_pages++;
+            } else {
+                u.file_pages++;
+            }
+        }
+    }
+
+    u.minor_faults = process->minor_faults;
+    u.major_faults = process->major_faults;
+    u.fork_copies = process->fork_copies;
+    u.mappings = process->mappings;
+}
+
+int fault_histogram(int core, uint32_t* counts) {
+    using namespace gheith;
+    int n = kConfig.totalProcs;
+    if (core >= n) return -1;
+
+    bzero(counts, sizeof(FaultHistogram::counts));
+    for (int c = 0; c < n; c++) {
+        if (core >= 0 && c != core) continue;
+        auto& h = fault_histograms.forCPU(c);
+        for (uint32_t i = 0; i < FAULT_PATHS * FAULT_BUCKETS; i++) {
+            counts[i] += h.counts[i / FAULT_BUCKETS][i % FAULT_BUCKETS];
+        }
+    }
+    return n;
+}
+
+void fault_report() {
+    using namespace gheith;
+    static const char* names[FAULT_PATHS] = { "anon", "cache", "disk", "kill" };
+    uint32_t counts[FAULT_PATHS][FAULT_BUCKETS];
+    fault_histogram(-1, &counts[0][0]);
+
+    Debug::printf("| page fault latency (log2 cycles:faults)\n");
+    for (uint32_t p = 0; p < FAULT_PATHS; p++) {
+        uint32_t total = 0;
+        for (uint32_t b = 0; b < FAULT_BUCKETS; b++) total += counts[p][b];
+        if (total == 0) continue;
+
+        Debug::printf("|   %s: %d", names[p], total);
+        for (uint32_t b = 0; b < FAULT_BUCKETS; b++) {
+            if (counts[p][b] != 0) Debug::printf(" %d:%d", b, counts[p][b]);
+        }
+        Debug::printf("\n|     per core:");
+        for (uint32_t c = 0; c < kConfig.totalProcs; c++) {
+            uint32_t mine = 0;
+            for (uint32_t b = 0; b < FAULT_BUCKETS; b++) mine += fault_histograms.forCPU(c).counts[p][b];
+            Debug::printf(" %d", mine);
+        }
+        Debug::printf("\n");
+    }
+}
+
+// Add a mapping of the file, the SharedMemory object or (neither) anonymous memory
+static void *map_entry (void *addr, size_t length, int prot, int flags, Shared<Node> file, Shared<SharedMemory> shm, off_t offset, size_t file_bytes) {
     using namespace gheith;
 
     // If address is not specified, default to first-fitting address.
@@ -251,25 +1509,73 @@ void *mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset
         return nullptr;
     }
 
-    // Create file and add to entry list.
-    Shared<Node> file = (Shared<Node>) nullptr;
-    if (fd >= 0) {
-        file = me->process->getFile(fd)->getNode();
-    } 
-
+    // Add to entry list.
     VMEntry* new_entry = new VMEntry(file, size, va, offset, temp, flags, prot);
+    new_entry->file_end = va + K::min(size, file_bytes);
+    new_entry->shm = shm;
     if (prev == nullptr) {
         me->process->entry_list = new_entry;
     } else {
         prev->next = new_entry;
     }
+    me->process->mappings++;
+
+    // writes through it only show up in the PTE dirty bits
+    if (file != nullptr && (flags & 0x1)) {
+        track_dirty(me->process->pd);
+    }
+
+    if (flags & MAP_POPULATE) {
+        populate(me->process->pd, new_entry);
+    }
     return (uint32_t*) va;
 }
 
+void *mmap_node (void *addr, size_t length, int prot, int flags, Shared<Node> file, off_t offset, size_t file_bytes) {
+    return map_entry(addr, length, prot, flags, file, Shared<SharedMemory>(), offset, file_bytes);
 }
 
+void *mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    Shared<Node> file = (Shared<Node>) nullptr;
+    Shared<SharedMemory> shm{};
+    uint32_t size = PhysMem::frameup(length);
+    if (fd >= 0) {
+        auto f = gheith::current()->process->getFile(fd);
+        if (f == nullptr) return nullptr;
+        shm = f->getShm();
+        if (shm == nullptr) {
+            file = f->getNode();
+        } else if (PhysMem::offset(offset) != 0 || uint32_t(offset) > shm->pages * PhysMem::FRAME_SIZE ||
+                size > shm->pages * PhysMem::FRAME_SIZE - offset) {
+            // has to fit in the object
+            return nullptr;
+        }
+    } else if (flags & 0x1) {
+        // shared anonymous memory, an object of its own that fork passes on
+        shm = Shared<SharedMemory>::make(size / PhysMem::FRAME_SIZE);
+        offset = 0;
+    }
+    return map_entry(addr, length, prot, flags, file, shm, offset, size);
+}
+
+}
+
+// Another core changed PTEs of an address space we have loaded
+extern "C" void tlbHandler() {
+    using namespace gheith;
+    if (sd_drop) {
+        stop_borrowing(sd_pd);
+    } else {
+        invalidate(sd_pd, sd_start, sd_end);
+    }
+    SMP::eoi();
+    sd_pending.add_fetch(-1);
+}
+
+// saveState[8] is the error code: bit 0 -> present, bit 1 -> write
 extern "C" void vmm_pageFault(uintptr_t va_, uintptr_t *saveState) {
     using namespace gheith;
+    auto start = rdtsc();
     auto me = current();
     ASSERT((uint32_t)me->process->pd == getCR3());
     ASSERT(me->saveArea.cr3 == getCR3());
@@ -285,60 +1591,28 @@ extern "C" void vmm_pageFault(uintptr_t va_, uintptr_t *saveState) {
             // Found the entry that the virtual address corresponds to.
             if (va >= vm_entry->starting_address && va < vm_entry->starting_address + vm_entry->size) {
 
-                uint32_t pa;
-
-                // If an anonymous or private mapping, allocate a new physical frame. If file has not
-                // been mapped yet, allocate a new physical frame.
-                if (vm_entry->file == nullptr || (vm_entry->flags & 0x1) == 0) {
-                    pa = PhysMem::alloc_frame();
+                bool major = false;
+                if (!fault_in(me->process->pd, vm_entry, va, (saveState[8] & 2) != 0, &major)) break;
+                if (major) {
+                    me->process->major_faults++;
                 } else {
-                    // Process shares mapping with other processes. See if it has been mapped already.
-                    NodeEntry* prev = nullptr;
-                    NodeEntry* node_entry = node_list;
-                    if (node_entry != nullptr) {
-                        while (node_entry != nullptr) {
-                            if (vm_entry->file->number == node_entry->file->number) {
-                                break;
-                            }
-                            prev = node_entry;
-                            node_entry = node_entry->next;
-                        }
-                    }
-                    if (node_entry != nullptr) {
-                        vm_entry->node = node_entry;
-                        pa = node_entry->pa;
-                        node_entry->num_processes++;
-                    } else {
-                        // File has not been mapped yet. We will read it in.
-                        pa = PhysMem::alloc_frame();
-                        NodeEntry* new_entry = new NodeEntry(vm_entry->file, pa);
-                        if (prev == nullptr) {
-                            node_list = new_entry;
-                        } else {
-                            prev->next = new_entry;
-                        }
-                        if (vm_entry->file != nullptr && (vm_entry->prot & 2) == 2) {
-                            auto read = vm_entry->file->read_all(vm_entry->offset + va - vm_entry->starting_address, PhysMem::FRAME_SIZE, (char*) pa);
-                            if (read != PhysMem::FRAME_SIZE) {
-                                if (read == -1) read = 0;
-                                for (int i = 0; i < PhysMem::FRAME_SIZE - read; i++) {
-                                    ((char*) pa)[read + i] = 0;
-                                }
-                            }
-                        } else {
-                            for (uint32_t i = 0; i < PhysMem::FRAME_SIZE; i++) {
-                                ((char*) pa)[i] = 0;
-                            }
-                        }
-                        vm_entry->node = new_entry;
-                    }
+                    me->process->minor_faults++;
                 }
-                user_map(me->process->pd, va, pa);
+
+                // the histograms time the fault, not the readahead
+                bool file = vm_entry->file != nullptr && (vm_entry->prot & 2) == 2 && va < vm_entry->file_end;
+                record_fault(major ? VMM::FAULT_DISK : file ? VMM::FAULT_CACHE : VMM::FAULT_ANON, start);
+
+                readahead(vm_entry, va);
                 return;
             }
             vm_entry = vm_entry->next;
         }
+        if (vm_entry != nullptr) {
+            Debug::printf("| out of memory, killing the process\n");
+        }
     }
+    record_fault(VMM::FAULT_KILL, start);
     current()->process->exit(1);
     stop();
 }
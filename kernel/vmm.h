@@ -3,11 +3,55 @@
 
 #include "stdint.h"
 #include "ext2.h"
+#include "shm.h"
+
+struct VMEntry;
 
 namespace gheith {
     extern uint32_t* make_pd();
-    extern void delete_pd(uint32_t*);
-    extern void delete_private(uint32_t*);
+
+    // Free the pages in the VMEntry ranges, the user page tables, and
+    // (delete_pd) the page directory itself
+    extern void delete_pd(uint32_t*, VMEntry* entries);
+    extern void delete_private(uint32_t*, VMEntry* entries);
+
+    constexpr uint32_t PTE_ACCESSED = 0x20;
+    constexpr uint32_t PTE_DIRTY = 0x40;
+
+    // One of the PTE bits the MMU leaves to software. Marks a frame that
+    // belongs to the page cache. Those frames are reference counted and
+    // written back when the last mapping goes away. MAP_SHARED mappings
+    // map them writable, private ones read-only until the first write.
+    constexpr uint32_t PTE_SHARED = 0x200;
+
+    // A non-present PTE with this bit set holds a swap slot in its
+    // upper 20 bits: (slot << 12) | PTE_SWAP
+    constexpr uint32_t PTE_SWAP = 0x400;
+
+    // A frame of a SharedMemory object (MAP_SHARED anonymous memory or
+    // shm_open). The object owns it, the PTE doesn't.
+    constexpr uint32_t PTE_SHM = 0x800;
+
+    // The read-only frame of zeros behind untouched anonymous memory
+    extern uint32_t zero_page;
+
+    // Interrupt vector for TLB shootdown IPIs
+    constexpr uint32_t TLB_VECTOR = 0xf0;
+
+    // Remember that the given core is about to load cr3
+    extern void note_cr3(uint32_t core, uint32_t cr3);
+
+    // Invalidate [start,end) of pd on every core that has it loaded,
+    // this one included. One IPI per core, ranges longer than a few
+    // pages flush the whole TLB. Call with interrupts enabled.
+    extern void shootdown(uint32_t* pd, uint32_t start, uint32_t end);
+
+    // Add a mapping to a page cache frame (fork shares them with the child)
+    extern void share_page(uint32_t pa);
+
+    // The address space has MAP_SHARED file mappings, the flusher should
+    // look at its dirty bits (until delete_pd)
+    extern void track_dirty(uint32_t* pd);
 }
 
 namespace VMM {
@@ -18,22 +62,98 @@ namespace VMM {
     // Called on each core to do per-core initialization
     extern void per_core_init();
 
+    // mmap flags: 0x1 shared (fd -1 shares anonymous memory with forked
+    // children), 0x2 fixed, and
+    constexpr int MAP_POPULATE = 0x4;   // make the whole range resident before returning
+
     extern void *mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 
+    // mmap for the kernel (exec), the file comes as a node instead of a
+    // descriptor. Only the first file_bytes of the range come from the
+    // file, the rest starts out as zeros (ELF bss).
+    extern void *mmap_node (void *addr, size_t length, int prot, int flags, Shared<Node> file, off_t offset, size_t file_bytes);
+
     extern int munmap (void *addr, size_t len);
 
+    // Is every page of [start, end) mapped in the current process?
+    extern bool mapped(uint32_t start, uint32_t end);
+
+    // msync flags
+    constexpr int MS_ASYNC = 1;       // schedule the writeback and return
+    constexpr int MS_INVALIDATE = 2;  // no-op, all mappings share the page cache
+    constexpr int MS_SYNC = 4;        // write back and wait for the disk
+
+    // Returns -1 if part of the range isn't mapped
+    extern int msync (void *addr, size_t len, int flags);
+
+    // madvise advice
+    constexpr int MADV_NORMAL = 0;      // default readahead
+    constexpr int MADV_RANDOM = 1;      // no readahead
+    constexpr int MADV_SEQUENTIAL = 2;  // read far ahead of faults
+    constexpr int MADV_WILLNEED = 3;    // read the pages in now
+    constexpr int MADV_DONTNEED = 4;    // free the pages now
+
+    extern int madvise (void *addr, size_t len, int advice);
+
+    // Try to free n frames by dropping unmapped page cache pages and
+    // swapping out pages of the current process. Returns how many frames
+    // it freed. PhysMem calls it when it runs dry, for callers that hold
+    // no locks (alloc_frame with reclaim = true).
+    extern uint32_t reclaim(uint32_t n);
+
+    // Start the background thread that writes dirty shared pages back
+    extern void start_flusher();
+
+    // Memory use of the current process (getrusage)
+    struct Usage {
+        uint32_t anon_pages;      // resident private frames
+        uint32_t file_pages;      // page cache frames of private file mappings
+        uint32_t shared_pages;    // page cache frames of MAP_SHARED mappings
+        uint32_t swap_pages;      // private pages out in swap
+        uint32_t minor_faults;
+        uint32_t major_faults;
+        uint32_t fork_copies;
+        uint32_t mappings;
+    };
+
+    extern void usage(Usage& u);
+
+    // Page fault latency, per path and per core. Bucket b counts the
+    // faults that took [2^b, 2^(b+1)) TSC cycles.
+    constexpr uint32_t FAULT_ANON = 0;      // zero page, zero fill, copy on write
+    constexpr uint32_t FAULT_CACHE = 1;     // file page already in the page cache
+    constexpr uint32_t FAULT_DISK = 2;      // had to read the file or swap
+    constexpr uint32_t FAULT_KILL = 3;      // bad address or out of memory
+    constexpr uint32_t FAULT_PATHS = 4;
+    constexpr uint32_t FAULT_BUCKETS = 32;
+
+    // Copy the histograms of one core (all of them if core < 0) into
+    // counts[FAULT_PATHS][FAULT_BUCKETS]. Returns the number of cores,
+    // -1 if there is no such core.
+    extern int fault_histogram(int core, uint32_t* counts);
+
+    // Print the histograms (at shutdown)
+    extern void fault_report();
+
 }
 
+// A page of a file in the page cache. There is one entry per (file,
+// page offset) no matter how many processes map it. Entries are found
+// by (inode, offset) and by frame through hash tables, see vmm.cc
 struct NodeEntry {
-    NodeEntry(Shared<Node> file, uint32_t pa) : file(file), pa(pa) {
-        num_processes = 1;
-        next = nullptr;
-    }
+    NodeEntry(Shared<Node> file, uint32_t offset, uint32_t pa) : file(file), offset(offset), pa(pa) {}
 
     Shared<Node> file;
-    uint32_t num_processes;
+    uint32_t offset;                  // page-aligned offset in the file
+    uint32_t num_mappings = 1;        // PTEs pointing at pa, 0 -> on the cached list
     uint32_t pa;
-    NodeEntry* next;
+    bool dirty = false;               // has changes that are not on disk yet
+    Atomic<bool> ready{true};         // false while the first fault reads it in
+    uint32_t pins = 0;                // write backs in progress, we can't free it
+    NodeEntry* prev = nullptr;        // on the mapped or the cached list
+    NodeEntry* next = nullptr;
+    NodeEntry* page_next = nullptr;   // hash chains
+    NodeEntry* frame_next = nullptr;
 };
 
 struct VMEntry {
@@ -47,7 +167,10 @@ struct VMEntry {
     VMEntry* next;
     uint32_t flags;
     uint32_t prot;
-    NodeEntry* node;
+    int advice = VMM::MADV_NORMAL;
+    uint32_t file_end = 0;     // the file's data stops at this address
+    Shared<SharedMemory> shm{};  // shared anonymous memory, instead of a file
+
 };
 
 #endif
@@ -1,193 +1,217 @@
 #include "libc.h"
 
-/* A first-fit heap */
+/* A size-class heap on top of mmap */
 
-#define INTS 0x100000
+/* Small requests (up to MAX_SMALL bytes) are rounded up to one of the size */
+/* classes and served from slabs, SLAB byte blocks that each hold objects */
+/* of one class. Slabs are carved from CHUNK byte anonymous mappings. Larger */
+/* requests get a mapping of their own that goes away on free. */
 
-static int array[INTS];
-static int heap_len = INTS;
-static int safe = 1;
-static int avail = 0;
+/* Every block has a header at its SLAB aligned start, so free finds it by */
+/* masking the pointer. Mappings are only page aligned, we map a little more */
+/* and round up. The extra pages are never touched and cost nothing. */
 
-static void makeTaken(int i, int ints);
-static void makeAvail(int i, int ints);
+/* Building with -DHEAP_DEBUG=1 checks every pointer handed to free and */
+/* realloc and catches double frees. */
 
-void heap_init() {
-    makeTaken(0,2);
-    makeAvail(2,heap_len-4);
-    makeTaken(heap_len-2,2);
-}
+#ifndef HEAP_DEBUG
+#define HEAP_DEBUG 0
+#endif
 
-static int abs(int x) {
-    if (x < 0) return -x; else return x;
-}
+#define PAGE 4096
+#define SLAB 0x10000
+#define CHUNK 0x100000
+#define MAX_SMALL 16384
 
-static int size(int i) {
-    return abs(array[i]);
-}
+/* read/write, same as the stack */
+#define PROT 0xa
 
-static int headerFromFooter(int i) {
-    return i - size(i) + 1;
-}
+#define MAGIC 0x51ab51ab
+#define LARGE (-1)
 
-static int footerFromHeader(int i) {
-    return i + size(i) - 1;
-}
-    
-static int sanity(int i) {
-    if (safe) {
-        if (i == 0) return 0;
-        if ((i < 0) || (i >= heap_len)) {
-//            Debug::panic("bad header index %d\n",i);
-            return i;
-        }
-        int footer = footerFromHeader(i);
-        if ((footer < 0) || (footer >= heap_len)) {
-//            Debug::panic("bad footer index %d\n",footer);
-            return i;
-        }
-        int hv = array[i];
-        int fv = array[footer];
-  
-        if (hv != fv) {
-//            Debug::panic("bad block at %d, %d != %d\n", i, hv, fv);
-            return i;
-        }
-    }
+static const int class_size[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+    1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384
+};
+#define NCLASSES ((int) (sizeof(class_size) / sizeof(class_size[0])))
 
-    return i;
-}
+struct slab {
+    uint32_t magic;
+    struct slab* next;         /* in partial[cls] or empty_slabs */
+    struct slab* prev;
+    void* free;                /* freed objects */
+    char* bump;                /* objects not handed out yet start here */
+    int used;                  /* objects in use, requested bytes for LARGE */
+    int cls;                   /* size class or LARGE */
+    size_t capacity;           /* objects in the slab, usable bytes for LARGE */
+};
 
-static int left(int i) {
-    return sanity(headerFromFooter(i-1));
-}
+/* keeps objects 16 byte aligned */
+#define HDR 32
 
-static int right(int i) {
-    return sanity(i + size(i));
-}
+/* size class of (bytes + 15) / 16 */
+static unsigned char class_of[MAX_SMALL / 16 + 1];
 
-static int next1(int i) {
-    return sanity(array[i+1]);
-}
+/* slabs with free objects, per class */
+static struct slab* partial[NCLASSES];
+
+/* slabs nothing is allocated from, any class can take them */
+static struct slab* empty_slabs = 0;
 
-static int prev1(int i) {
-    return sanity(array[i+2]);
+/* the part of the newest chunk that hasn't been made into slabs */
+static char* chunk_next = 0;
+static char* chunk_end = 0;
+
+void heap_init() {
+    int c = 0;
+    for (int i = 0; i <= MAX_SMALL / 16; i++) {
+        while (class_size[c] < i * 16) c++;
+        class_of[i] = c;
+    }
 }
 
-static void next(int i, int x) {
-    array[i+1] = x;
+static struct slab* slab_of(void* p) {
+    return (struct slab*) (((uint32_t) p) & ~(SLAB - 1));
 }
 
-static void prev(int i, int x) {
-    array[i+2] = x;
+/* maps at least 'bytes' starting at a SLAB boundary, sets *end to the end */
+/* of the mapping */
+static char* map(size_t bytes, char** end) {
+    size_t length = bytes + SLAB - PAGE;
+    if (length < bytes) return 0;
+    char* va = mmap(0, length, PROT, 0, -1, 0);
+    if (va == 0) return 0;
+    *end = va + length;
+    return (char*) (((uint32_t) va + SLAB - 1) & ~(SLAB - 1));
 }
 
-static void remove(int i) {
-    int prevIndex = prev1(i);
-    int nextIndex = next1(i);
+static void push(struct slab** list, struct slab* s) {
+    s->prev = 0;
+    s->next = *list;
+    if (*list != 0) (*list)->prev = s;
+    *list = s;
+}
 
-    if (prevIndex == 0) {
-        /* at head */
-        avail = nextIndex;
+static void unlink(struct slab** list, struct slab* s) {
+    if (s->prev == 0) {
+        *list = s->next;
     } else {
-        /* in the middle */
-        next(prevIndex,nextIndex);
-    }
-    if (nextIndex != 0) {
-        prev(nextIndex,prevIndex);
+        s->prev->next = s->next;
     }
+    if (s->next != 0) s->next->prev = s->prev;
 }
 
-static void makeAvail(int i, int ints) {
-    array[i] = ints;
-    array[footerFromHeader(i)] = ints;    
-    next(i,avail);
-    prev(i,0);
-    if (avail != 0) {
-        prev(avail,i);
+static struct slab* new_slab(int c) {
+    struct slab* s = empty_slabs;
+    if (s != 0) {
+        unlink(&empty_slabs, s);
+    } else {
+        if (chunk_next == chunk_end) {
+            char* end;
+            char* start = map(CHUNK, &end);
+            if (start == 0) return 0;
+            chunk_next = start;
+            chunk_end = start + CHUNK;
+        }
+        s = (struct slab*) chunk_next;
+        chunk_next += SLAB;
     }
-    avail = i;
-}
-
-static void makeTaken(int i, int ints) {
-    array[i] = -ints;
-    array[footerFromHeader(i)] = -ints;    
-}
-
-static int isAvail(int i) {
-    return array[i] > 0;
+    s->magic = MAGIC;
+    s->cls = c;
+    s->free = 0;
+    s->bump = ((char*) s) + HDR;
+    s->used = 0;
+    s->capacity = (SLAB - HDR) / class_size[c];
+    push(&partial[c], s);
+    return s;
+}
+
+static void* large_malloc(size_t bytes) {
+    size_t need = (bytes + HDR + PAGE - 1) & ~(PAGE - 1);
+    if (need < bytes) return 0;
+    /* room for realloc to grow into, untouched pages are free */
+    size_t reserve = need + ((need / 4) & ~(PAGE - 1));
+    char* end;
+    struct slab* s = (struct slab*) map(reserve, &end);
+    if (s == 0) return 0;
+    s->magic = MAGIC;
+    s->cls = LARGE;
+    s->used = bytes;
+    s->capacity = end - (((char*) s) + HDR);
+    return ((char*) s) + HDR;
+}
+
+static int bad(const char* what, void* p) {
+    printf("*** heap: %s %p\n", what, p);
+    return 1;
+}
+
+/* 0 if p could have come from malloc and is still allocated */
+static int check(void* p) {
+    if (!HEAP_DEBUG) return 0;
+    struct slab* s = slab_of(p);
+    uint32_t offset = ((char*) p) - ((char*) s);
+    if ((uint32_t) p < 0x80000000 || offset < HDR) return bad("not a heap pointer", p);
+    if (s->magic != MAGIC) return bad("bad block header at", s);
+    if (s->cls == LARGE) {
+        if (offset != HDR) return bad("not the start of a block", p);
+        return 0;
+    }
+    if (s->cls < 0 || s->cls >= NCLASSES) return bad("bad block header at", s);
+    int sz = class_size[s->cls];
+    if ((offset - HDR) % sz != 0 || ((char*) p) >= s->bump) return bad("not the start of a block", p);
+    for (void* f = s->free; f != 0; f = *((void**) f)) {
+        if (f == p) return bad("double free", p);
+    }
+    return 0;
 }
 
-static int isTaken(int i) {
-    return array[i] < 0;
-}
-    
 void* malloc(size_t bytes) {
-    //Debug::printf("malloc(%d)\n",bytes);
-    if (bytes == 0) return (void*) array;
+    if (bytes > MAX_SMALL) return large_malloc(bytes);
 
-    int ints = ((bytes + 3) / 4) + 2;
-    if (ints < 4) ints = 4;
-
-    int p = avail;
-    sanity(p);
+    int c = class_of[(bytes + 15) / 16];
+    struct slab* s = partial[c];
+    if (s == 0) {
+        s = new_slab(c);
+        if (s == 0) return 0;
+    }
 
-    void* res = 0;
-    while ((p != 0) && (res == 0)) {
-        if (!isAvail(p)) {
-            //Debug::panic("block @ %d is not available\n",p);
-        }
-        int sz = size(p);
-        if (sz >= ints) {
-            remove(p);
-            int extra = sz - ints;
-            if (extra >= 4) {
-                makeTaken(p,ints);
-                //Debug::printf("idx = %d, sz = %d, ptr = %p\n",p,ints,&array[p+1]);
-                makeAvail(p+ints,extra);
-            } else {
-                makeTaken(p,sz);
-                //Debug::printf("idx = %d, sz = %d, ptr = %p\n",p,sz,&array[p+1]);
-            }
-            res = &array[p+1];
-        } else {
-            p = next1(p);
-        }
+    void* p = s->free;
+    if (p != 0) {
+        s->free = *((void**) p);
+    } else {
+        p = s->bump;
+        s->bump += class_size[c];
     }
-    if (res == 0) {
-        //Debug::panic("heap is full, bytes=0x%x",bytes);
+    s->used++;
+    if (s->used == s->capacity) {
+        unlink(&partial[c], s);
     }
-    return res;
-}        
+    return p;
+}
 
 void free(void* p) {
     if (p == 0) return;
-    if (p == (void*) array) return;
+    if (check(p)) return;
 
-    int idx = ((((long) p) - ((long) array)) / 4) - 1;
-    sanity(idx);
-    if (!isTaken(idx)) {
-        //Debug::panic("freeing free block %p %d\n",p,idx);
+    struct slab* s = slab_of(p);
+    int c = s->cls;
+    if (c == LARGE) {
+        munmap(s, s->capacity);
         return;
     }
 
-    int sz = size(idx);
-
-    int leftIndex = left(idx);
-    int rightIndex = right(idx);
-
-    if (isAvail(leftIndex)) {
-        remove(leftIndex);
-        idx = leftIndex;
-        sz += size(leftIndex);
+    *((void**) p) = s->free;
+    s->free = p;
+    if (s->used == s->capacity) {
+        push(&partial[c], s);
     }
-
-    if (isAvail(rightIndex)) {
-        remove(rightIndex);
-        sz += size(rightIndex);
+    s->used--;
+    /* keep one slab per class so a malloc/free loop doesn't churn */
+    if (s->used == 0 && (partial[c] != s || s->next != 0)) {
+        unlink(&partial[c], s);
+        push(&empty_slabs, s);
     }
-
-    makeAvail(idx,sz);
 }
 
 void* realloc(void* p, size_t newSize) {
@@ -198,21 +222,29 @@ void* realloc(void* p, size_t newSize) {
         free(p);
         return 0;
     }
-    int idx = ((((long) p) - ((long) array)) / 4) - 1;
-    sanity(idx);
-    if (!isTaken(idx)) {
-        //Debug::panic("freeing free block %p %d\n",p,idx);
-        return 0;
+    if (check(p)) return 0;
+
+    struct slab* s = slab_of(p);
+    size_t sz;
+    if (s->cls == LARGE) {
+        /* grow or shrink within the mapping */
+        if (newSize <= s->capacity && newSize > MAX_SMALL) {
+            s->used = newSize;
+            return p;
+        }
+        sz = s->used;
+    } else {
+        sz = class_size[s->cls];
+        if (newSize <= sz && (s->cls == 0 || newSize > class_size[s->cls - 1])) {
+            return p;
+        }
     }
 
-    long sz = size(idx) * 4;
-
     void* newPtr = malloc(newSize);
     if (newPtr) {
-        long m = (newSize > sz) ? sz : newSize;
+        size_t m = (newSize > sz) ? sz : newSize;
         memcpy(newPtr,p,m);
-    }    
-
-    free(p);
+        free(p);
+    }
     return newPtr;
 }
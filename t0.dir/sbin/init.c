@@ -1,5 +1,16 @@
 #include "libc.h"
 
+/* page faults taken while writing to the first byte of each page */
+static uint32_t faults_touching(char* p, int pages) {
+    struct rusage before, after;
+    getrusage(&before);
+    for (int i = 0; i < pages; i++) {
+        p[i * 4096] = 1;
+    }
+    getrusage(&after);
+    return (after.minor_faults + after.major_faults) - (before.minor_faults + before.major_faults);
+}
+
 int main(int argc, char** argv) {
     printf("****************************\n");
     printf("*** MMAP AND MUNAP TESTS ***\n");
@@ -70,6 +81,91 @@ int main(int argc, char** argv) {
     // File contents should print.
     printf("%s\n", p3);
 
+    // msync writes the dirty pages of a shared mapping back to the file, read() sees them after.
+    printf("***\n");
+    int fd3 = open("/data/data.txt", 0);
+    char* p7 = (char*) mmap(0, 1, 2, 1, fd3, 0);
+    p7[4] = 'S';
+    printf("*** msync returns %d\n", msync(p7, 1, MS_SYNC));
+    printf("*** msync of an unmapped range returns %d\n", msync((void*) 0xa0000000, 4096, MS_SYNC));
+    printf("*** msync with MS_SYNC and MS_ASYNC returns %d\n", msync(p7, 1, MS_SYNC | MS_ASYNC));
+    char buf[64];
+    int fd4 = open("/data/data.txt", 0);
+    int n = read(fd4, buf, sizeof(buf) - 1);
+    buf[n < 0 ? 0 : n] = 0;
+    printf("*** reading data.txt after msync:\n");
+    printf("%s", buf);
+    munmap(p7, 1);
+
+    // No msync: the flusher finds the write in the page table and writes it back on its own.
+    int fd6 = open("/data/panic.txt", 0);
+    char* p8 = (char*) mmap(0, 4096, 2, 1, fd6, 0);
+    p8[4] = 'W';
+    sleep(2500);
+    int fd7 = open("/data/panic.txt", 0);
+    n = read(fd7, buf, 16);
+    buf[n < 0 ? 0 : n] = 0;
+    printf("*** reading panic.txt after the flusher ran:\n");
+    printf("%s", buf);
+    munmap(p8, 4096);
+    close(fd6);
+    close(fd7);
+
+    // Named shared memory: a forked child opens it by name and sees the same frames.
+    printf("***\n");
+    int shm = shm_open("/shm_test", 8192);
+    char* s = (char*) mmap(0, 8192, 2, 1, shm, 0);
+    int child2 = fork();
+    if (child2 == 0) {
+        int fd5 = shm_open("/shm_test", 0);
+        char* c = (char*) mmap(0, 8192, 2, 1, fd5, 0);
+        memcpy(c + 4096, "*** the child wrote this through shm_open", 42);
+        exit(0);
+    }
+    wait(child2, &status);
+    printf("%s\n", s + 4096);
+    // munmap (and exit) in one process leaves the frames to the object, the other still sees them
+    const char kept[] = "*** still there after the child's munmap";
+    memcpy(s, (void*) kept, sizeof(kept));
+    int child3 = fork();
+    if (child3 == 0) {
+        munmap(s, 8192);
+        // likely to get the frames back if munmap freed them
+        char* scratch = (char*) mmap(0, 16 * 4096, 2, MAP_POPULATE, -1, 0);
+        memset(scratch, '#', 16 * 4096);
+        exit(0);
+    }
+    wait(child3, &status);
+    printf("%s\n", s);
+    printf("*** shm_unlink returns %d\n", shm_unlink("/shm_test"));
+    printf("*** shm_unlink again returns %d\n", shm_unlink("/shm_test"));
+    printf("*** shm_open of a bad name returns %d\n", shm_open((const char*) 0xa0000000, 4096));
+
+    // MAP_POPULATE: every page is there when mmap returns, touching them doesn't fault.
+    printf("***\n");
+    faults_touching((char*) mmap(0, 4 * 4096, 2, 0, -1, 0), 4);
+    char* pop = (char*) mmap(0, 4 * 4096, 2, MAP_POPULATE, -1, 0);
+    printf("*** touching 4 populated pages faulted %ld times\n", faults_touching(pop, 4));
+
+    // Big blocks come straight from mmap, realloc keeps what fits.
+    printf("***\n");
+    int ok = 1;
+    char* big = (char*) malloc(100000);
+    for (int i = 0; i < 100000; i++) big[i] = i % 251;
+    big = (char*) realloc(big, 300000);
+    for (int i = 0; i < 100000; i++) if (big[i] != (char) (i % 251)) ok = 0;
+    for (int i = 100000; i < 300000; i++) big[i] = i % 251;
+    big = (char*) realloc(big, 5000);
+    for (int i = 0; i < 5000; i++) if (big[i] != (char) (i % 251)) ok = 0;
+    char* small = (char*) malloc(100);
+    memset(small, 7, 100);
+    small = (char*) realloc(small, 200000);
+    for (int i = 0; i < 100; i++) if (small[i] != 7) ok = 0;
+    free(big);
+    free(small);
+    printf("*** malloc and realloc of big blocks %s\n", ok ? "kept their contents" : "lost data");
+    printf("***\n");
+
     // Process does not have read permissions. Attempts to read the region should fail.
     printf("*** mapping file without reading permission\n");
     char* p6 = (char*) mmap(0, 1, 0, 1, fd, 0);
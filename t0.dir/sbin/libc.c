@@ -1,8 +1,73 @@
 #include "libc.h"
 
+/* output buffers for the first NBUF descriptors. consoles are line */
+/* buffered, files are written when the buffer fills */
+
+#define NBUF 10
+#define BUFSIZE 512
+
+#define UNKNOWN 0
+#define LINE 1
+#define FULL 2
+
+struct buffer {
+    int mode;
+    int n;
+    char data[BUFSIZE];
+};
+
+static struct buffer buffers[NBUF];
+
+static int flush(int fd) {
+    struct buffer* b = &buffers[fd];
+    char* ptr = b->data;
+    int n = b->n;
+    b->n = 0;
+    while (n > 0) {
+        ssize_t m = write(fd,ptr,n);
+        if (m <= 0) return -1;
+        n -= m;
+        ptr += m;
+    }
+    return 0;
+}
+
+int fflush(int fd) {
+    if (fd == -1) {
+        int rc = 0;
+        for (int i=0; i<NBUF; i++) {
+            if (buffers[i].n > 0 && flush(i) < 0) rc = -1;
+        }
+        return rc;
+    }
+    if ((fd < 0) || (fd >= NBUF)) return 0;
+    return flush(fd);
+}
+
+void stdio_close(int fd) {
+    if ((fd < 0) || (fd >= NBUF)) return;
+    flush(fd);
+    buffers[fd].mode = UNKNOWN;
+}
+
+int dputc(int fd, int c) {
+    if ((fd < 0) || (fd >= NBUF)) {
+        char t = (char)c;
+        return (write(fd,&t,1) == 1) ? (c & 0xff) : -1;
+    }
+    struct buffer* b = &buffers[fd];
+    if (b->mode == UNKNOWN) {
+        b->mode = (len(fd) < 0) ? LINE : FULL;
+    }
+    b->data[b->n++] = (char)c;
+    if ((b->n == BUFSIZE) || ((b->mode == LINE) && (c == '\n'))) {
+        if (flush(fd) < 0) return -1;
+    }
+    return c & 0xff;
+}
+
 int putchar(int c) {
-    char t = (char)c;
-    return write(1,&t,1);
+    return dputc(1,c);
 }
 
 int puts(const char* p) {
@@ -19,6 +84,7 @@ int puts(const char* p) {
 }
 
 void cp(int from, int to) {
+    fflush(to);
     while (1) {
         char buf[100];
         ssize_t n = read(from,buf,100);
@@ -16,6 +16,14 @@ extern void* realloc(void* ptr, size_t newSize);
 void* memset(void* p, int val, size_t sz);
 void* memcpy(void* dest, void* src, size_t n);
 
+/* output to descriptors below 10 is buffered, consoles a line at a time */
+/* and files until the buffer fills. exit, fork, execl and shutdown flush */
+/* everything, close flushes its descriptor. write() bypasses the buffers */
+extern int dputc(int fd, int c);
+/* fd -1 flushes all the buffers */
+extern int fflush(int fd);
+extern void stdio_close(int fd);
+
 extern int putchar(int c);
 extern int puts(const char *p);
 
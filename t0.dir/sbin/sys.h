@@ -78,10 +78,117 @@ extern int fork();
 /* a nullptr indicates end of arguments */
 extern int execl(const char* path, const char* arg0, ...);
 
+/* mmap */
+/* flags: 0x1 -> shared, 0x2 -> fixed address */
+/* shared with fd -1 is anonymous memory shared with forked children */
+/* fd can be a shm_open descriptor, offset and length must fit in it */
+/* MAP_POPULATE reads the whole range in before mmap returns */
+#define MAP_POPULATE 0x4
 extern void *mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 
 extern int munmap (void *addr, size_t len);
 
 extern int kill (int id);
 
+/* msync */
+/* writes the dirty pages of the MAP_SHARED file mappings in [addr,addr+len) */
+/* back to their files. addr must be page aligned */
+/* MS_ASYNC schedules the writes, MS_SYNC waits for them to reach the disk */
+/* the last munmap of a shared page writes it back implicitly */
+/* return 0 on success, -ve value on failure (bad flags, part of the range */
+/* not mapped) */
+#define MS_ASYNC 1
+#define MS_INVALIDATE 2
+#define MS_SYNC 4
+extern int msync (void *addr, size_t len, int flags);
+
+/* madvise */
+/* tells the kernel how [addr,addr+len) is going to be used. addr must be */
+/* page aligned. the hint applies to each whole mapping the range touches */
+/* MADV_SEQUENTIAL reads far ahead of faults, MADV_RANDOM turns readahead off */
+/* MADV_WILLNEED reads the file (and swapped out) pages in right away */
+/* MADV_DONTNEED frees the pages now, the next touch sees zeros (anonymous */
+/* memory) or the file's contents */
+/* return 0 on success, -ve value on failure */
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+extern int madvise (void *addr, size_t len, int advice);
+
+/* getrusage */
+/* fills in the memory use of the calling process. page counts are */
+/* taken when it is called, the counters start at zero in fork children */
+/* return 0 on success, -ve value on failure */
+struct rusage {
+    uint32_t anon_pages;     /* resident private pages */
+    uint32_t file_pages;     /* file pages shared read-only (program text) */
+    uint32_t shared_pages;   /* pages of MAP_SHARED file mappings */
+    uint32_t swap_pages;     /* pages out in swap */
+    uint32_t minor_faults;   /* page faults served from memory */
+    uint32_t major_faults;   /* page faults that read swap or a file */
+    uint32_t fork_copies;    /* pages copied by fork for our children */
+    uint32_t mappings;       /* number of mmap'ed ranges */
+};
+extern int getrusage(struct rusage *usage);
+
+/* faultstats */
+/* page fault latency histograms since boot: counts[path][b] is the number */
+/* of faults on that path that took between 2^b and 2^(b+1) TSC cycles */
+/* core < 0 adds up all the cores */
+/* returns the number of cores, -ve value on failure */
+#define FAULT_ANON 0      /* zero page, zero fill, copy on write */
+#define FAULT_CACHE 1     /* file page already in memory */
+#define FAULT_DISK 2      /* had to read the file or swap */
+#define FAULT_KILL 3      /* bad address or out of memory */
+#define FAULT_PATHS 4
+#define FAULT_BUCKETS 32
+extern int faultstats(int core, uint32_t counts[FAULT_PATHS][FAULT_BUCKETS]);
+
+/* shm_open */
+/* opens the named shared memory object, making a zero-filled one of */
+/* 'size' bytes if there is none. mmap the descriptor (MAP_SHARED) to */
+/* use it, every process that maps it sees the same memory */
+/* returns a file descriptor */
+extern int shm_open(const char* name, size_t size);
+
+/* shm_unlink */
+/* removes the name, the memory stays around while it is mapped or open */
+/* return 0 on success, -ve value on failure */
+extern int shm_unlink(const char* name);
+
+/* heapstats */
+/* the kernel heap: usage, fragmentation and the allocation sites */
+/* holding the most memory. one in 64 allocations is sampled, a site's */
+/* live_bytes times 64 estimates what it holds. pc is a kernel address */
+/* in_use, high_water, class_allocs and the sites stay 0 unless the */
+/* kernel is built with HEAP_STATS=1 */
+/* return 0 on success, -ve value on failure */
+struct heapsite {
+    uint32_t pc;
+    uint32_t samples;
+    uint32_t live;
+    uint32_t live_bytes;
+};
+struct heapstats {
+    uint32_t in_use;             /* bytes allocated */
+    uint32_t high_water;
+    uint32_t free_blocks;        /* fragmentation of the general heap */
+    uint32_t free_bytes;
+    uint32_t largest_free;
+    uint32_t cached_bytes;       /* free small objects */
+    uint32_t chunks;             /* memory the heap took from the frame allocator */
+    uint32_t class_allocs[9];    /* allocations of 16, 32 ... 2048 bytes, bigger */
+    uint32_t dropped;
+    uint32_t nsites;
+    struct heapsite sites[16];   /* most live bytes first */
+};
+extern int heapstats(struct heapstats *stats);
+
+/* sleep */
+/* blocks the calling process for at least ms milliseconds */
+/* return 0 */
+extern int sleep(uint32_t ms);
+
 #endif